@@ -0,0 +1,76 @@
+#ifndef LINE_H
+#define LINE_H
+
+#include "global.h"
+
+#define LINE_MAX_LEN		(4096)
+
+/*
+ * A line assembled from the received stream. Lines are split on '\n' (which
+ * is kept in buf) or when buf is full, in which case partial is set. The
+ * offset and the timestamps belong to the read() that delivered the first
+ * byte of the line.
+ */
+struct line {
+	char buf[LINE_MAX_LEN];
+	size_t len;
+	u64 offset;
+	struct timespec mono;
+	struct timespec wall;
+	bool partial;
+};
+
+typedef void (*line_cb_t)(struct line *line, void *ctx);
+
+static inline void line_init(struct line *line)
+{
+	line->len = 0;
+	line->partial = false;
+}
+
+static inline void line_feed(struct line *line, const char *data, size_t len,
+			     u64 offset, const struct timespec *mono,
+			     const struct timespec *wall, line_cb_t cb, void *ctx)
+{
+	const char *nl;
+	size_t n;
+
+	while (len) {
+		if (line->len == 0) {
+			line->offset = offset;
+			line->mono = *mono;
+			line->wall = *wall;
+		}
+
+		nl = memchr(data, '\n', len);
+		n = nl ? (size_t)(nl - data) + 1 : len;
+		if (n > LINE_MAX_LEN - line->len) {
+			n = LINE_MAX_LEN - line->len;
+			nl = NULL;
+		}
+
+		memcpy(line->buf + line->len, data, n);
+		line->len += n;
+		data += n;
+		len -= n;
+		offset += n;
+
+		if (nl || line->len == LINE_MAX_LEN) {
+			line->partial = (nl == NULL);
+			cb(line, ctx);
+			line_init(line);
+		}
+	}
+}
+
+// Emit what is left of an unterminated line, e.g. on exit
+static inline void line_flush(struct line *line, line_cb_t cb, void *ctx)
+{
+	if (line->len == 0)
+		return;
+	line->partial = true;
+	cb(line, ctx);
+	line_init(line);
+}
+
+#endif // LINE_H
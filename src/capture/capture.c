@@ -0,0 +1,458 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#if defined(LINUX)
+#include <sys/timerfd.h>
+#endif
+
+#include "capture.h"
+
+#define CAPTURE_TAIL_BUF_SIZE		(64 * 1024)
+#define CAPTURE_COPY_BUF_SIZE		(64 * 1024)
+
+void capture_chown(const char *file_name, bool verbose)
+{
+	// Attempt to retrieve the original user's UID and GID from environment variables
+	char *sudo_uid_str = getenv("SUDO_UID");
+	char *sudo_gid_str = getenv("SUDO_GID");
+
+	if ((sudo_uid_str != NULL) && (sudo_gid_str != NULL)) {
+		// Convert string values to uid_t and gid_t types
+		uid_t uid = (uid_t)atoi(sudo_uid_str);
+		gid_t gid = (gid_t)atoi(sudo_gid_str);
+
+		if (chown(file_name, uid, gid) == -1) {
+			fprintf(stderr, "Error: Failed to change file ownership: %s (%d)\n",
+				strerror(errno), errno);
+		} else if (verbose) {
+			printf("Info: Successfully changed file ownership back to UID: %d, GID: %d\n",
+				uid, gid);
+		}
+	} else if (verbose) {
+		printf("Info: Sudo environment not detected, file will retain current executor's ownership.\n");
+	}
+}
+
+static int capture_fopen(struct capture *cap)
+{
+	cap->fp = fopen(cap->file_name, "w");
+	if (cap->fp == NULL) {
+		fprintf(stderr, "Error: Failed to open the file '%s': %s (%d)\n",
+			cap->file_name, strerror(errno), errno);
+		return -errno;
+	}
+	cap->file_bytes = 0;
+	capture_chown(cap->file_name, cap->rotations == 0);
+
+	return 0;
+}
+
+/*
+ * The log file is opened by a helper thread so that reading the serial port
+ * starts right away. Until the file is ready, capture_write() only appends to
+ * the backlog; capture_open() does not touch the backlog fields, so the two
+ * threads never share data before the helper is joined.
+ */
+int capture_backlog_init(struct capture *cap, size_t size)
+{
+	cap->backlog = malloc(size);
+	if (cap->backlog == NULL) {
+		fprintf(stderr, "Error: Failed to allocate memory: %s (%d)\n",
+			strerror(errno), errno);
+		return -ENOMEM;
+	}
+	cap->backlog_len = 0;
+	cap->backlog_size = size;
+	cap->backlog_dropped = 0;
+
+	return 0;
+}
+
+void capture_backlog_free(struct capture *cap)
+{
+	free(cap->backlog);
+	cap->backlog = NULL;
+}
+
+// Write the backlog into the file opened meanwhile by capture_open()
+int capture_backlog_flush(struct capture *cap)
+{
+	char *backlog = cap->backlog;
+	int ret = 0;
+
+	if (backlog == NULL)
+		return 0;
+
+	cap->backlog = NULL;
+	ret = capture_write(cap, backlog, cap->backlog_len);
+	if (ret == 0 && cap->backlog_dropped)
+		fprintf(cap->fp, "\n[atty: %llu bytes dropped, backlog full]\n",
+			cap->backlog_dropped);
+	free(backlog);
+
+	return ret;
+}
+
+int capture_open(struct capture *cap, const char *file_name)
+{
+	char temp[PATH_MAX];
+
+	cap->file_name = file_name;
+	cap->total_bytes = 0;
+	cap->dropped_bytes = 0;
+	cap->rotations = 0;
+	cap->oldest_rotation = 1;
+	cap->tail_fd = -1;
+	cap->tail_buf = NULL;
+	cap->tail_buf_len = 0;
+	cap->tail_pos = 0;
+	cap->watchdog_fd = -1;
+	cap->suspended = false;
+
+	strncpy(temp, file_name, sizeof(temp) - 1);
+	temp[sizeof(temp) - 1] = '\0';
+	strcpy(cap->dir_name, dirname(temp));
+
+	return capture_fopen(cap);
+}
+
+static int capture_fwrite(struct capture *cap, const char *buf, size_t len)
+{
+	if (fwrite(buf, 1, len, cap->fp) != len) {
+		fprintf(stderr, "Error: Failed to write the file '%s': %s (%d)\n",
+			cap->file_name, strerror(errno), errno);
+		return -errno;
+	}
+	cap->file_bytes += len;
+
+	return 0;
+}
+
+static int capture_remove_oldest(struct capture *cap)
+{
+	char name[PATH_MAX + 16];
+
+	if (cap->oldest_rotation > cap->rotations)
+		return -1;
+
+	snprintf(name, sizeof(name), "%s.%d", cap->file_name, cap->oldest_rotation++);
+	if (unlink(name) != 0 && errno != ENOENT) {
+		fprintf(stderr, "Error: Failed to remove the file '%s': %s (%d)\n",
+			name, strerror(errno), errno);
+		return -errno;
+	}
+
+	return 0;
+}
+
+static int capture_rotate(struct capture *cap)
+{
+	char name[PATH_MAX + 16];
+	int ret;
+
+	ret = fclose(cap->fp);
+	cap->fp = NULL;
+	if (ret < 0)
+		fprintf(stderr, "Error: Failed to close the file '%s': %s (%d)\n",
+			cap->file_name, strerror(errno), errno);
+
+	snprintf(name, sizeof(name), "%s.%d", cap->file_name, ++cap->rotations);
+	if (rename(cap->file_name, name) != 0) {
+		fprintf(stderr, "Error: Failed to rename '%s' to '%s': %s (%d)\n",
+			cap->file_name, name, strerror(errno), errno);
+		return -errno;
+	}
+
+	if (cap->rotate_keep > 0) {
+		while (cap->rotations - cap->oldest_rotation + 1 > cap->rotate_keep)
+			capture_remove_oldest(cap);
+	}
+
+	return capture_fopen(cap);
+}
+
+static int capture_tail_flush(struct capture *cap)
+{
+	const char *p = cap->tail_buf;
+	size_t len = cap->tail_buf_len;
+	size_t off, n;
+
+	while (len) {
+		off = cap->tail_pos % cap->tail_size;
+		n = cap->tail_size - off;
+		if (n > len)
+			n = len;
+		if (pwrite(cap->tail_fd, p, n, off) != (ssize_t)n) {
+			fprintf(stderr, "Error: Failed to write the file '%s': %s (%d)\n",
+				cap->tail_name, strerror(errno), errno);
+			return -errno;
+		}
+		cap->tail_pos += n;
+		p += n;
+		len -= n;
+	}
+	cap->tail_buf_len = 0;
+
+	return 0;
+}
+
+static int capture_tail_write(struct capture *cap, const char *buf, size_t len)
+{
+	size_t n;
+	int ret;
+
+	if (cap->tail_fd < 0) {
+		// The buffer first, so a failure leaves no half set up tail behind
+		if (cap->tail_buf == NULL) {
+			cap->tail_buf = malloc(CAPTURE_TAIL_BUF_SIZE);
+			if (cap->tail_buf == NULL) {
+				fprintf(stderr, "Error: Failed to allocate memory: %s (%d)\n",
+					strerror(errno), errno);
+				return -ENOMEM;
+			}
+		}
+
+		snprintf(cap->tail_name, sizeof(cap->tail_name), "%s.tail", cap->file_name);
+		cap->tail_fd = open(cap->tail_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (cap->tail_fd < 0) {
+			fprintf(stderr, "Error: Failed to open the file '%s': %s (%d)\n",
+				cap->tail_name, strerror(errno), errno);
+			return -errno;
+		}
+		capture_chown(cap->tail_name, false);
+	}
+
+	while (len) {
+		n = CAPTURE_TAIL_BUF_SIZE - cap->tail_buf_len;
+		if (n > len)
+			n = len;
+		memcpy(cap->tail_buf + cap->tail_buf_len, buf, n);
+		cap->tail_buf_len += n;
+		buf += n;
+		len -= n;
+
+		if (cap->tail_buf_len == CAPTURE_TAIL_BUF_SIZE) {
+			ret = capture_tail_flush(cap);
+			if (ret)
+				return ret;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Append the tail ring to the head file in chronological order, separated by
+ * a marker telling how many bytes were skipped in between.
+ */
+static int capture_tail_join(struct capture *cap)
+{
+	char buf[CAPTURE_COPY_BUF_SIZE];
+	u64 kept, skipped, start;
+	size_t n;
+	ssize_t bytes_read;
+	int ret;
+
+	ret = capture_tail_flush(cap);
+	if (ret)
+		return ret;
+
+	kept = cap->tail_pos < (u64)cap->tail_size ? cap->tail_pos : (u64)cap->tail_size;
+	skipped = cap->tail_pos - kept;
+	start = cap->tail_pos > kept ? cap->tail_pos % cap->tail_size : 0;
+
+	if (skipped)
+		fprintf(cap->fp, "\n[atty: %llu bytes skipped]\n", skipped);
+
+	while (kept) {
+		n = cap->tail_size - start;
+		if (n > sizeof(buf))
+			n = sizeof(buf);
+		if (n > kept)
+			n = kept;
+		bytes_read = pread(cap->tail_fd, buf, n, start);
+		if (bytes_read <= 0) {
+			fprintf(stderr, "Error: Failed to read the file '%s': %s (%d)\n",
+				cap->tail_name, strerror(errno), errno);
+			return -EIO;
+		}
+		ret = capture_fwrite(cap, buf, bytes_read);
+		if (ret)
+			return ret;
+		start = (start + bytes_read) % cap->tail_size;
+		kept -= bytes_read;
+	}
+
+	return 0;
+}
+
+int capture_write(struct capture *cap, const void *buf, size_t len)
+{
+	const char *p = buf;
+	size_t n;
+	int ret;
+
+	if (cap->backlog) {
+		n = cap->backlog_size - cap->backlog_len;
+		if (n > len)
+			n = len;
+		memcpy(cap->backlog + cap->backlog_len, buf, n);
+		cap->backlog_len += n;
+		cap->backlog_dropped += len - n;
+		return 0;
+	}
+
+	cap->total_bytes += len;
+	if (cap->fp == NULL || cap->suspended) {
+		cap->dropped_bytes += len;
+		return 0;
+	}
+
+	while (len) {
+		n = len;
+		switch (cap->mode) {
+		case CAPTURE_LIMIT_STOP:
+		case CAPTURE_LIMIT_ROTATE:
+			if (cap->limit > 0 && n > cap->limit - cap->file_bytes)
+				n = cap->limit - cap->file_bytes;
+			ret = capture_fwrite(cap, p, n);
+			if (ret)
+				return ret;
+			if (cap->limit > 0 && cap->file_bytes >= cap->limit) {
+				if (cap->mode == CAPTURE_LIMIT_STOP)
+					return CAPTURE_LIMIT_REACHED;
+				ret = capture_rotate(cap);
+				if (ret)
+					return ret;
+			}
+			break;
+		case CAPTURE_LIMIT_HEAD_TAIL:
+			if (cap->file_bytes < cap->head_size) {
+				if (n > cap->head_size - cap->file_bytes)
+					n = cap->head_size - cap->file_bytes;
+				ret = capture_fwrite(cap, p, n);
+			} else {
+				ret = capture_tail_write(cap, p, n);
+			}
+			if (ret)
+				return ret;
+			break;
+		}
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+int capture_close(struct capture *cap)
+{
+	int ret = 0;
+
+	if (cap->watchdog_fd >= 0) {
+		close(cap->watchdog_fd);
+		cap->watchdog_fd = -1;
+	}
+
+	if (cap->tail_fd >= 0) {
+		if (cap->fp)
+			ret = capture_tail_join(cap);
+		close(cap->tail_fd);
+		cap->tail_fd = -1;
+		if (ret == 0)
+			unlink(cap->tail_name);
+	}
+	free(cap->tail_buf);
+	cap->tail_buf = NULL;
+
+	if (cap->fp) {
+		if (fclose(cap->fp) < 0) {
+			fprintf(stderr, "Error: Failed to close the file '%s': %s (%d)\n",
+				cap->file_name, strerror(errno), errno);
+			ret = -errno;
+		}
+		cap->fp = NULL;
+	}
+
+	return ret;
+}
+
+/*
+ * The watchdog is a periodic timerfd polled next to the serial port. Every
+ * tick checks the free space of the capture's filesystem with statvfs() and
+ * suspends the capture before the filesystem runs full. Rotate mode removes
+ * the oldest rotated file first.
+ */
+int capture_watchdog_init(struct capture *cap, int interval_s)
+{
+	#if defined(LINUX)
+	struct itimerspec its = {
+		.it_interval = { .tv_sec = interval_s },
+		.it_value = { .tv_sec = interval_s },
+	};
+
+	cap->watchdog_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (cap->watchdog_fd < 0) {
+		fprintf(stderr, "Error: Failed to create the watchdog timer: %s (%d)\n",
+			strerror(errno), errno);
+		return -errno;
+	}
+
+	if (timerfd_settime(cap->watchdog_fd, 0, &its, NULL) < 0) {
+		fprintf(stderr, "Error: Failed to arm the watchdog timer: %s (%d)\n",
+			strerror(errno), errno);
+		close(cap->watchdog_fd);
+		cap->watchdog_fd = -1;
+		return -errno;
+	}
+
+	return cap->watchdog_fd;
+	#else
+	return -ENOSYS;
+	#endif
+}
+
+int capture_watchdog_check(struct capture *cap)
+{
+	struct statvfs st;
+	u64 expirations;
+	u64 avail;
+
+	if (read(cap->watchdog_fd, &expirations, sizeof(expirations)) < 0)
+		return 0;
+
+	if (cap->fp == NULL || cap->min_free <= 0)
+		return 0;
+
+	if (statvfs(cap->dir_name, &st) != 0) {
+		fprintf(stderr, "Error: Failed to get the file system status of '%s': %s (%d)\n",
+			cap->dir_name, strerror(errno), errno);
+		return -errno;
+	}
+	avail = (u64)st.f_bavail * st.f_frsize;
+
+	if (!cap->suspended && avail < (u64)cap->min_free) {
+		if (cap->mode == CAPTURE_LIMIT_ROTATE && capture_remove_oldest(cap) == 0)
+			return 0;
+		fflush(cap->fp);
+		cap->suspended = true;
+		cap->suspended_at = cap->dropped_bytes;
+		fprintf(stderr, "\nWarning: Only %llu bytes left on '%s', capture suspended\n",
+			avail, cap->dir_name);
+	} else if (cap->suspended && avail >= 2 * (u64)cap->min_free) {
+		cap->suspended = false;
+		fprintf(cap->fp, "\n[atty: %llu bytes dropped, low disk space]\n",
+			cap->dropped_bytes - cap->suspended_at);
+		fprintf(stderr, "\nInfo: %llu bytes free on '%s', capture resumed\n",
+			avail, cap->dir_name);
+	}
+
+	return 0;
+}
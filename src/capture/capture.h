@@ -0,0 +1,65 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <limits.h>
+#include "types.h"
+
+#define CAPTURE_LIMIT_REACHED		(1)
+#define CAPTURE_BACKLOG_SIZE		(4 * 1024 * 1024)
+
+enum capture_limit_mode {
+	CAPTURE_LIMIT_STOP = 0,		// end the session when the limit is hit
+	CAPTURE_LIMIT_ROTATE,		// rename to <file>.N and start a new file
+	CAPTURE_LIMIT_HEAD_TAIL,	// keep the first and the last bytes only
+};
+
+struct capture
+{
+	FILE *fp;
+	const char *file_name;
+	int mode;
+	long limit;			// bytes per file, 0 = unlimited
+	long rotate_keep;		// rotated files to keep, 0 = all
+	long head_size;
+	long tail_size;
+	long min_free;			// watchdog threshold in bytes, 0 = off
+
+	u64 file_bytes;			// bytes in the current file
+	u64 total_bytes;		// bytes handed to capture_write()
+	u64 dropped_bytes;		// bytes not written while suspended
+	int rotations;
+	int oldest_rotation;		// lowest <file>.N still on disk
+	char dir_name[PATH_MAX];
+
+	// head-tail: the tail is a ring kept in '<file>.tail'
+	int tail_fd;
+	char *tail_buf;
+	size_t tail_buf_len;
+	u64 tail_pos;
+	char tail_name[PATH_MAX + 8];
+
+	int watchdog_fd;
+	bool suspended;
+	u64 suspended_at;		// dropped_bytes when suspended
+
+	// Bytes received before the file is open, owned by the reader thread
+	char *backlog;
+	size_t backlog_len;
+	size_t backlog_size;
+	u64 backlog_dropped;
+};
+
+extern void capture_chown(const char *file_name, bool verbose);
+extern int capture_backlog_init(struct capture *cap, size_t size);
+extern int capture_backlog_flush(struct capture *cap);
+extern void capture_backlog_free(struct capture *cap);
+extern int capture_open(struct capture *cap, const char *file_name);
+extern int capture_write(struct capture *cap, const void *buf, size_t len);
+extern int capture_close(struct capture *cap);
+
+extern int capture_watchdog_init(struct capture *cap, int interval_s);
+extern int capture_watchdog_check(struct capture *cap);
+
+#endif
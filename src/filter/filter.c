@@ -0,0 +1,603 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "filter.h"
+
+enum {
+	NODE_SET = 0,		// consumes a byte in set, then goes to out
+	NODE_SPLIT,		// goes to out and out1
+	NODE_EPS,		// goes to out, -1 until the fragment is joined
+	NODE_MATCH,		// pattern found
+	NODE_MATCH_END,		// pattern found if the line ends here
+};
+
+// A piece of the NFA with one entry and one dangling NODE_EPS exit
+struct frag
+{
+	int start;
+	int end;
+};
+
+struct parser
+{
+	struct filter_set *fs;
+	const char *p;
+	const char *end;
+	const char *expr;
+	int err;
+};
+
+static void parse_error(struct parser *ps, const char *msg)
+{
+	if (ps->err == 0)
+		fprintf(stderr, "Error: Invalid filter %s: %s\n", ps->expr, msg);
+	ps->err = -EINVAL;
+}
+
+static int node_new(struct parser *ps, int type)
+{
+	struct filter_set *fs = ps->fs;
+	struct filter_node *n;
+
+	if (fs->nodes_len == FILTER_NODES_MAX) {
+		parse_error(ps, "too many patterns");
+		return 0;
+	}
+
+	n = &fs->nodes[fs->nodes_len];
+	memset(n, 0, sizeof(*n));
+	n->type = type;
+	n->out = -1;
+	n->out1 = -1;
+
+	return fs->nodes_len++;
+}
+
+static inline void set_add(u64 *set, int c)
+{
+	set[c >> 6] |= 1ULL << (c & 63);
+}
+
+static inline bool set_has(const u64 *set, int c)
+{
+	return (set[c >> 6] >> (c & 63)) & 1;
+}
+
+static void set_add_range(u64 *set, int lo, int hi)
+{
+	for (int c = lo; c <= hi; c++)
+		set_add(set, c);
+}
+
+static struct frag frag_set(struct parser *ps, const u64 *set)
+{
+	struct frag f;
+
+	f.start = node_new(ps, NODE_SET);
+	f.end = node_new(ps, NODE_EPS);
+	memcpy(ps->fs->nodes[f.start].set, set, sizeof(ps->fs->nodes[0].set));
+	ps->fs->nodes[f.start].out = f.end;
+
+	return f;
+}
+
+static struct frag frag_cat(struct parser *ps, struct frag a, struct frag b)
+{
+	ps->fs->nodes[a.end].out = b.start;
+	return (struct frag){ a.start, b.end };
+}
+
+// \d \w \s and their negations, or an escaped character
+static void parse_escape(struct parser *ps, u64 *set)
+{
+	u64 cls[4] = { 0 };
+	bool negate = false;
+	char c;
+
+	if (ps->p == ps->end) {
+		parse_error(ps, "trailing backslash");
+		return;
+	}
+
+	c = *ps->p++;
+	switch (c) {
+	case 'D':
+		negate = true;
+		// fall through
+	case 'd':
+		set_add_range(cls, '0', '9');
+		break;
+	case 'W':
+		negate = true;
+		// fall through
+	case 'w':
+		set_add_range(cls, '0', '9');
+		set_add_range(cls, 'a', 'z');
+		set_add_range(cls, 'A', 'Z');
+		set_add(cls, '_');
+		break;
+	case 'S':
+		negate = true;
+		// fall through
+	case 's':
+		set_add(cls, ' ');
+		set_add_range(cls, '\t', '\r');
+		break;
+	case 't':
+		set_add(cls, '\t');
+		break;
+	case 'r':
+		set_add(cls, '\r');
+		break;
+	case 'n':
+		set_add(cls, '\n');
+		break;
+	default:
+		set_add(cls, (u8)c);
+		break;
+	}
+
+	for (int i = 0; i < 4; i++)
+		set[i] |= negate ? ~cls[i] : cls[i];
+}
+
+// [abc], [a-z], [^0-9], the opening bracket is already taken
+static void parse_class(struct parser *ps, u64 *set)
+{
+	u64 cls[4] = { 0 };
+	bool negate = false;
+	int lo, hi;
+
+	if (ps->p < ps->end && *ps->p == '^') {
+		negate = true;
+		ps->p++;
+	}
+
+	// A leading ']' is a literal
+	if (ps->p < ps->end && *ps->p == ']') {
+		set_add(cls, ']');
+		ps->p++;
+	}
+
+	while (ps->p < ps->end && *ps->p != ']') {
+		if (*ps->p == '\\') {
+			ps->p++;
+			parse_escape(ps, cls);
+			continue;
+		}
+
+		lo = (u8)*ps->p++;
+		if (ps->end - ps->p >= 2 && ps->p[0] == '-' && ps->p[1] != ']') {
+			hi = (u8)ps->p[1];
+			ps->p += 2;
+			if (hi < lo) {
+				parse_error(ps, "bad range in class");
+				return;
+			}
+			set_add_range(cls, lo, hi);
+		} else {
+			set_add(cls, lo);
+		}
+	}
+
+	if (ps->p == ps->end) {
+		parse_error(ps, "missing ]");
+		return;
+	}
+	ps->p++;
+
+	for (int i = 0; i < 4; i++)
+		set[i] = negate ? ~cls[i] : cls[i];
+}
+
+static struct frag parse_alt(struct parser *ps);
+
+static struct frag parse_atom(struct parser *ps)
+{
+	u64 set[4] = { 0 };
+	struct frag f;
+	char c = *ps->p++;
+
+	switch (c) {
+	case '(':
+		f = parse_alt(ps);
+		if (ps->p == ps->end || *ps->p != ')') {
+			parse_error(ps, "missing )");
+			return f;
+		}
+		ps->p++;
+		return f;
+	case '[':
+		parse_class(ps, set);
+		break;
+	case '.':
+		memset(set, 0xff, sizeof(set));
+		break;
+	case '\\':
+		parse_escape(ps, set);
+		break;
+	case '*':
+	case '+':
+	case '?':
+		parse_error(ps, "nothing to repeat");
+		break;
+	case '^':
+	case '$':
+		parse_error(ps, "^ and $ are only supported at the ends");
+		break;
+	default:
+		set_add(set, (u8)c);
+		break;
+	}
+
+	return frag_set(ps, set);
+}
+
+static struct frag parse_repeat(struct parser *ps)
+{
+	struct filter_node *nodes = ps->fs->nodes;
+	struct frag f = parse_atom(ps);
+	int split, end;
+
+	while (ps->p < ps->end && !ps->err &&
+	       (*ps->p == '*' || *ps->p == '+' || *ps->p == '?')) {
+		split = node_new(ps, NODE_SPLIT);
+		end = node_new(ps, NODE_EPS);
+		nodes[split].out = f.start;
+		nodes[split].out1 = end;
+
+		switch (*ps->p++) {
+		case '*':
+			nodes[f.end].out = split;
+			f.start = split;
+			break;
+		case '+':
+			nodes[f.end].out = split;
+			break;
+		case '?':
+			nodes[f.end].out = end;
+			f.start = split;
+			break;
+		}
+		f.end = end;
+	}
+
+	return f;
+}
+
+static struct frag parse_cat(struct parser *ps)
+{
+	struct frag f;
+
+	f.start = f.end = node_new(ps, NODE_EPS);
+
+	while (ps->p < ps->end && *ps->p != '|' && *ps->p != ')' && !ps->err)
+		f = frag_cat(ps, f, parse_repeat(ps));
+
+	return f;
+}
+
+static struct frag parse_alt(struct parser *ps)
+{
+	struct filter_node *nodes = ps->fs->nodes;
+	struct frag f = parse_cat(ps), g;
+	int split, end;
+
+	while (ps->p < ps->end && *ps->p == '|' && !ps->err) {
+		ps->p++;
+		g = parse_cat(ps);
+		split = node_new(ps, NODE_SPLIT);
+		end = node_new(ps, NODE_EPS);
+		nodes[split].out = f.start;
+		nodes[split].out1 = g.start;
+		nodes[f.end].out = end;
+		nodes[g.end].out = end;
+		f = (struct frag){ split, end };
+	}
+
+	return f;
+}
+
+static int filter_parse(struct filter_set *fs, int id, const char *expr)
+{
+	const char *s = fs->text[id];
+	size_t len = strlen(s);
+	struct parser ps = { .fs = fs, .expr = expr };
+	struct frag f;
+	u64 set[4];
+	int match_type = NODE_MATCH;
+	int match;
+
+	fs->anchored[id] = false;
+
+	if (len >= 2 && s[0] == '/' && s[len - 1] == '/') {
+		// /regex/
+		ps.p = s + 1;
+		ps.end = s + len - 1;
+		if (ps.p < ps.end && *ps.p == '^') {
+			fs->anchored[id] = true;
+			ps.p++;
+		}
+		if (ps.p < ps.end && ps.end[-1] == '$' &&
+		    (ps.end - ps.p < 2 || ps.end[-2] != '\\')) {
+			match_type = NODE_MATCH_END;
+			ps.end--;
+		}
+
+		f = parse_alt(&ps);
+		if (ps.p != ps.end)
+			parse_error(&ps, "unbalanced )");
+	} else {
+		// Plain substring
+		f.start = f.end = node_new(&ps, NODE_EPS);
+		for (size_t i = 0; i < len && !ps.err; i++) {
+			memset(set, 0, sizeof(set));
+			set_add(set, (u8)s[i]);
+			f = frag_cat(&ps, f, frag_set(&ps, set));
+		}
+	}
+
+	match = node_new(&ps, match_type);
+	if (ps.err)
+		return ps.err;
+
+	fs->nodes[match].pattern = id;
+	fs->nodes[f.end].out = match;
+	fs->start[id] = f.start;
+
+	return 0;
+}
+
+/*
+ * Add "[+|-]pattern" to the view of a sink: '+' or no prefix includes the
+ * matching lines, '-' excludes them. "/.../" is a regex with . [] * + ? |
+ * () and ^ $ at the ends, anything else a plain substring. A pattern used
+ * by several sinks is compiled once.
+ */
+int filter_add(struct filter_set *fs, struct filter *f, const char *expr)
+{
+	const char *s = expr;
+	bool exclude = false;
+	int id, ret;
+
+	if (*s == '+' || *s == '-')
+		exclude = (*s++ == '-');
+
+	if (*s == '\0' || strlen(s) >= FILTER_PATTERN_LEN) {
+		fprintf(stderr, "Error: Invalid filter %s\n", expr);
+		return -EINVAL;
+	}
+
+	for (id = 0; id < fs->patterns; id++)
+		if (strcmp(fs->text[id], s) == 0)
+			break;
+
+	if (id == fs->patterns) {
+		if (fs->patterns == FILTER_PATTERNS_MAX) {
+			fprintf(stderr, "Error: Too many filters, at most %d\n",
+				FILTER_PATTERNS_MAX);
+			return -EINVAL;
+		}
+		strcpy(fs->text[id], s);
+		ret = filter_parse(fs, id, expr);
+		if (ret)
+			return ret;
+		fs->patterns++;
+	}
+
+	if (exclude)
+		f->exclude |= 1ULL << id;
+	else
+		f->include |= 1ULL << id;
+
+	return 0;
+}
+
+struct builder
+{
+	struct filter_set *fs;
+	int words;			// u64 words of an NFA node set
+	u64 *sets;			// node set of every DFA state
+	int *hash;			// open addressing, DFA state + 1
+	int hash_size;
+	int *stack;
+	u64 *restart;			// where the unanchored patterns begin
+};
+
+static void closure(struct builder *b, u64 *set, int node)
+{
+	struct filter_node *nodes = b->fs->nodes;
+	int sp = 0;
+
+	b->stack[sp++] = node;
+	while (sp) {
+		node = b->stack[--sp];
+		if (node < 0 || set_has(set, node))
+			continue;
+		set_add(set, node);
+
+		if (nodes[node].type == NODE_SPLIT) {
+			b->stack[sp++] = nodes[node].out;
+			b->stack[sp++] = nodes[node].out1;
+		} else if (nodes[node].type == NODE_EPS) {
+			b->stack[sp++] = nodes[node].out;
+		}
+	}
+}
+
+static u32 set_hash(const u64 *set, int words)
+{
+	u64 h = 0;
+
+	for (int i = 0; i < words; i++)
+		h = (h ^ set[i]) * 0x100000001b3ULL;
+
+	return h ^ (h >> 32);
+}
+
+// Returns the DFA state of the node set, adding it if it is new
+static int state_get(struct builder *b, const u64 *set)
+{
+	struct filter_set *fs = b->fs;
+	u64 *s;
+	int i, id;
+
+	i = set_hash(set, b->words) & (b->hash_size - 1);
+	while ((id = b->hash[i]) != 0) {
+		if (memcmp(&b->sets[(size_t)(id - 1) * b->words], set,
+			   b->words * sizeof(u64)) == 0)
+			return id - 1;
+		i = (i + 1) & (b->hash_size - 1);
+	}
+
+	if (fs->states == FILTER_DFA_MAX)
+		return -1;
+
+	id = fs->states++;
+	s = &b->sets[(size_t)id * b->words];
+	memcpy(s, set, b->words * sizeof(u64));
+	b->hash[i] = id + 1;
+
+	fs->accept[id] = 0;
+	fs->accept_end[id] = 0;
+	for (int n = 0; n < fs->nodes_len; n++) {
+		if (!set_has(s, n))
+			continue;
+		if (fs->nodes[n].type == NODE_MATCH)
+			fs->accept[id] |= 1ULL << fs->nodes[n].pattern;
+		else if (fs->nodes[n].type == NODE_MATCH_END)
+			fs->accept_end[id] |= 1ULL << fs->nodes[n].pattern;
+	}
+
+	return id;
+}
+
+// Bytes that are in the same sets of every NODE_SET share a class
+static void filter_classes(struct filter_set *fs)
+{
+	u8 map[256][2];
+	bool used[256][2];
+	int classes = 1;
+
+	memset(fs->byte_class, 0, sizeof(fs->byte_class));
+
+	for (int n = 0; n < fs->nodes_len; n++) {
+		if (fs->nodes[n].type != NODE_SET)
+			continue;
+
+		memset(used, 0, sizeof(used));
+		int next = 0;
+		for (int c = 0; c < 256; c++) {
+			int old = fs->byte_class[c];
+			int in = set_has(fs->nodes[n].set, c);
+
+			if (!used[old][in]) {
+				used[old][in] = true;
+				map[old][in] = next++;
+			}
+			fs->byte_class[c] = map[old][in];
+		}
+		classes = next;
+	}
+
+	fs->classes = classes;
+}
+
+/*
+ * Subset construction of the DFA from the NFA of all patterns. Unanchored
+ * patterns may begin at any byte, so their start nodes are part of every
+ * state.
+ */
+int filter_compile(struct filter_set *fs)
+{
+	struct builder b = { .fs = fs };
+	u64 *set, *next_set;
+	int rep[256];
+	int ret = 0;
+
+	if (fs->patterns == 0)
+		return 0;
+
+	filter_classes(fs);
+	for (int c = 255; c >= 0; c--)
+		rep[fs->byte_class[c]] = c;
+
+	b.words = (fs->nodes_len + 63) / 64;
+	b.hash_size = FILTER_DFA_MAX * 2;
+	b.sets = malloc((size_t)FILTER_DFA_MAX * b.words * sizeof(u64));
+	b.hash = calloc(b.hash_size, sizeof(int));
+	b.stack = malloc((fs->nodes_len * 2 + 1) * sizeof(int));
+	b.restart = calloc(b.words, sizeof(u64));
+	set = malloc(b.words * sizeof(u64) * 2);
+	fs->next = malloc((size_t)FILTER_DFA_MAX * fs->classes * sizeof(u16));
+	fs->accept = malloc(FILTER_DFA_MAX * sizeof(u64));
+	fs->accept_end = malloc(FILTER_DFA_MAX * sizeof(u64));
+
+	if (!b.sets || !b.hash || !b.stack || !b.restart || !set ||
+	    !fs->next || !fs->accept || !fs->accept_end) {
+		fprintf(stderr, "Error: Failed to allocate the filters: %s (%d)\n",
+			strerror(ENOMEM), ENOMEM);
+		ret = -ENOMEM;
+		goto out;
+	}
+	next_set = set + b.words;
+
+	// State 0 starts every pattern
+	memset(set, 0, b.words * sizeof(u64));
+	for (int id = 0; id < fs->patterns; id++) {
+		closure(&b, set, fs->start[id]);
+		if (!fs->anchored[id])
+			closure(&b, b.restart, fs->start[id]);
+	}
+	state_get(&b, set);
+
+	for (int s = 0; s < fs->states; s++) {
+		for (int cls = 0; cls < fs->classes; cls++) {
+			const u64 *cur = &b.sets[(size_t)s * b.words];
+			int t;
+
+			memcpy(next_set, b.restart, b.words * sizeof(u64));
+			for (int w = 0; w < b.words; w++) {
+				for (u64 bits = cur[w]; bits; bits &= bits - 1) {
+					struct filter_node *n = &fs->nodes[w * 64 + __builtin_ctzll(bits)];
+
+					if (n->type == NODE_SET && set_has(n->set, rep[cls]))
+						closure(&b, next_set, n->out);
+				}
+			}
+
+			t = state_get(&b, next_set);
+			if (t < 0) {
+				fprintf(stderr, "Error: Filters too complex, more than %d states\n",
+					FILTER_DFA_MAX);
+				ret = -E2BIG;
+				goto out;
+			}
+			fs->next[s * fs->classes + cls] = t;
+		}
+	}
+
+out:
+	free(b.sets);
+	free(b.hash);
+	free(b.stack);
+	free(b.restart);
+	free(set);
+	if (ret)
+		filter_free(fs);
+
+	return ret;
+}
+
+void filter_free(struct filter_set *fs)
+{
+	free(fs->next);
+	free(fs->accept);
+	free(fs->accept_end);
+	fs->next = NULL;
+	fs->accept = NULL;
+	fs->accept_end = NULL;
+	fs->states = 0;
+}
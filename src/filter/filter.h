@@ -0,0 +1,84 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stddef.h>
+#include "types.h"
+
+#define FILTER_PATTERNS_MAX		(64)		// one bit of the match mask each
+#define FILTER_PATTERN_LEN		(256)
+#define FILTER_NODES_MAX		(4096)
+#define FILTER_DFA_MAX			(4096)
+
+/*
+ * The view of one sink: a line passes when it matches one of the include
+ * patterns, or there are none, and none of the exclude patterns.
+ */
+struct filter
+{
+	u64 include;
+	u64 exclude;
+};
+
+struct filter_node
+{
+	u8 type;
+	u8 pattern;
+	int out;
+	int out1;
+	u64 set[4];
+};
+
+/*
+ * The patterns of all sinks, compiled into one DFA. Every DFA state carries
+ * the mask of the patterns found so far, so a line is scanned once whatever
+ * the number of patterns and sinks.
+ */
+struct filter_set
+{
+	int patterns;
+	char text[FILTER_PATTERNS_MAX][FILTER_PATTERN_LEN];
+	int start[FILTER_PATTERNS_MAX];
+	bool anchored[FILTER_PATTERNS_MAX];
+
+	struct filter_node nodes[FILTER_NODES_MAX];
+	int nodes_len;
+
+	// DFA over byte classes, bytes no pattern tells apart share a column
+	u8 byte_class[256];
+	int classes;
+	int states;
+	u16 *next;
+	u64 *accept;
+	u64 *accept_end;			// patterns anchored with '$'
+};
+
+extern int filter_add(struct filter_set *fs, struct filter *f, const char *expr);
+extern int filter_compile(struct filter_set *fs);
+extern void filter_free(struct filter_set *fs);
+
+static inline bool filter_active(const struct filter *f)
+{
+	return f->include || f->exclude;
+}
+
+static inline bool filter_pass(const struct filter *f, u64 match)
+{
+	return (!f->include || (match & f->include)) && !(match & f->exclude);
+}
+
+static inline u64 filter_match(const struct filter_set *fs, const char *s, size_t len)
+{
+	const u16 *next = fs->next;
+	const u8 *p = (const u8 *)s;
+	u32 state = 0;
+	u64 match = fs->accept[0];
+
+	for (size_t i = 0; i < len; i++) {
+		state = next[state * fs->classes + fs->byte_class[p[i]]];
+		match |= fs->accept[state];
+	}
+
+	return match | fs->accept_end[state];
+}
+
+#endif
@@ -0,0 +1,450 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "frame.h"
+
+#define SLIP_END			(0xc0)
+#define SLIP_ESC			(0xdb)
+#define SLIP_ESC_END			(0xdc)
+#define SLIP_ESC_ESC			(0xdd)
+
+#define HDLC_FLAG			(0x7e)
+#define HDLC_ESC			(0x7d)
+#define HDLC_XOR			(0x20)
+
+#define COBS_DELIM			(0x00)
+
+// Reflected CRCs: running the CRC over data plus the appended CRC gives a constant
+#define CRC16_INIT			(0xffff)
+#define CRC16_GOOD			(0xf0b8)
+#define CRC32_INIT			(0xffffffff)
+#define CRC32_GOOD			(0xdebb20e3)
+
+enum {
+	FRAME_STATE_TEXT = 0,
+	FRAME_STATE_DATA,
+	FRAME_STATE_ESCAPE,
+};
+
+static u16 crc16_table[256];
+static u32 crc32_table[256];
+static bool crc_tables_ready;
+
+static void crc_init_tables(void)
+{
+	for (int i = 0; i < 256; i++) {
+		u16 c = i;
+		u32 d = i;
+
+		for (int k = 0; k < 8; k++) {
+			c = (c & 1) ? (c >> 1) ^ 0x8408 : c >> 1;
+			d = (d & 1) ? (d >> 1) ^ 0xedb88320 : d >> 1;
+		}
+		crc16_table[i] = c;
+		crc32_table[i] = d;
+	}
+	crc_tables_ready = true;
+}
+
+void frame_decoder_init(struct frame_decoder *dec, int type, int crc,
+			frame_cb_t cb, void *ctx)
+{
+	if (!crc_tables_ready)
+		crc_init_tables();
+
+	// HDLC always carries a frame check sequence
+	if (type == FRAME_HDLC && crc == FRAME_CRC_NONE)
+		crc = FRAME_CRC16;
+
+	dec->type = type;
+	dec->crc = crc;
+	dec->state = FRAME_STATE_TEXT;
+	dec->delim = type == FRAME_SLIP ? SLIP_END :
+		     type == FRAME_HDLC ? HDLC_FLAG : COBS_DELIM;
+	dec->offset = 0;
+	dec->raw_len = 0;
+	dec->cb = cb;
+	dec->ctx = ctx;
+	dec->frames = 0;
+	dec->crc_errors = 0;
+	dec->overflows = 0;
+	dec->aborts = 0;
+}
+
+/*
+ * Open a candidate at the delimiter at offset. One that also closed a good
+ * frame is not part of the text should the candidate be given back. Only
+ * done with a check that can tell the text after a frame from the next one.
+ */
+static void frame_start(struct frame_decoder *dec, u64 offset, bool shared)
+{
+	dec->state = FRAME_STATE_DATA;
+	dec->len = 0;
+	dec->aborted = false;
+	dec->cobs_code = 0;
+	dec->cobs_left = 0;
+	dec->crc_val = dec->crc == FRAME_CRC32 ? CRC32_INIT : CRC16_INIT;
+	dec->frame_offset = offset;
+	dec->raw_open = shared ? 0 : 1;
+	dec->raw_len = dec->raw_open;
+	dec->raw[0] = dec->delim;
+}
+
+static inline void frame_put(struct frame_decoder *dec, u8 c)
+{
+	// Never more than the raw bytes, but keep the copy in bounds anyway
+	if (dec->len == FRAME_MAX_LEN)
+		return;
+	dec->buf[dec->len++] = c;
+
+	if (dec->crc == FRAME_CRC16)
+		dec->crc_val = (dec->crc_val >> 8) ^ crc16_table[(dec->crc_val ^ c) & 0xff];
+	else if (dec->crc == FRAME_CRC32)
+		dec->crc_val = (dec->crc_val >> 8) ^ crc32_table[(dec->crc_val ^ c) & 0xff];
+}
+
+// Give the candidate back as text and drop out of the frame
+static size_t frame_reject(struct frame_decoder *dec, char *text)
+{
+	size_t n = dec->raw_len;
+
+	memcpy(text, dec->raw, n);
+	dec->raw_len = 0;
+	dec->state = FRAME_STATE_TEXT;
+
+	return n;
+}
+
+/*
+ * The delimiter at offset closes the candidate. Returns the number of bytes
+ * given back to text.
+ */
+static size_t frame_end(struct frame_decoder *dec, u64 offset, char *text)
+{
+	size_t crc_len = 0, n;
+
+	// Repeated delimiters are empty frames, the candidate stays open
+	if (dec->raw_len == dec->raw_open) {
+		dec->frame_offset = offset;
+		return 0;
+	}
+
+	// A block cut short by the delimiter
+	if (dec->type == FRAME_COBS && dec->cobs_left)
+		dec->aborted = true;
+
+	if (dec->aborted) {
+		dec->aborts++;
+		goto reject;
+	}
+
+	if (dec->crc == FRAME_CRC16) {
+		crc_len = 2;
+		if (dec->len < crc_len || dec->crc_val != CRC16_GOOD) {
+			dec->crc_errors++;
+			goto reject;
+		}
+	} else if (dec->crc == FRAME_CRC32) {
+		crc_len = 4;
+		if (dec->len < crc_len || dec->crc_val != CRC32_GOOD) {
+			dec->crc_errors++;
+			goto reject;
+		}
+	}
+
+	dec->frames++;
+	if (dec->cb)
+		dec->cb(dec->buf, dec->len - crc_len, dec->frame_offset, dec->ctx);
+	if (dec->crc != FRAME_CRC_NONE) {
+		frame_start(dec, offset, true);
+	} else {
+		dec->raw_len = 0;
+		dec->state = FRAME_STATE_TEXT;
+	}
+	return 0;
+
+reject:
+	// The delimiter that closed it may open a real frame
+	n = frame_reject(dec, text);
+	frame_start(dec, offset, false);
+	return n;
+}
+
+static void frame_cobs(struct frame_decoder *dec, u8 c)
+{
+	if (dec->cobs_left == 0) {
+		// Every block but a 0xff one stands for data followed by a zero
+		if (dec->cobs_code && dec->cobs_code != 0xff)
+			frame_put(dec, 0);
+		dec->cobs_code = c;
+		dec->cobs_left = c - 1;
+	} else {
+		frame_put(dec, c);
+		dec->cobs_left--;
+	}
+}
+
+static void frame_slip(struct frame_decoder *dec, u8 c)
+{
+	if (dec->state == FRAME_STATE_ESCAPE) {
+		dec->state = FRAME_STATE_DATA;
+		if (c == SLIP_ESC_END) {
+			frame_put(dec, SLIP_END);
+			return;
+		} else if (c == SLIP_ESC_ESC) {
+			frame_put(dec, SLIP_ESC);
+			return;
+		}
+		dec->aborted = true;
+	}
+
+	if (c == SLIP_ESC)
+		dec->state = FRAME_STATE_ESCAPE;
+	else
+		frame_put(dec, c);
+}
+
+static void frame_hdlc(struct frame_decoder *dec, u8 c)
+{
+	if (dec->state == FRAME_STATE_ESCAPE) {
+		dec->state = FRAME_STATE_DATA;
+		frame_put(dec, c ^ HDLC_XOR);
+		return;
+	}
+
+	if (c == HDLC_ESC)
+		dec->state = FRAME_STATE_ESCAPE;
+	else
+		frame_put(dec, c);
+}
+
+/*
+ * Decode a received chunk. Frames are passed to the callback as soon as they
+ * are complete; the text in between, including candidates given back, is
+ * copied to text and its length is returned. text must hold len +
+ * FRAME_MAX_LEN bytes. The bytes of a candidate still open at the end of the
+ * chunk are held back until it closes or frame_flush() is called.
+ */
+size_t frame_decode(struct frame_decoder *dec, const char *data, size_t len,
+		    char *text)
+{
+	const u8 *in = (const u8 *)data;
+	size_t i = 0, out = 0, n;
+	const u8 *p;
+	u8 c;
+
+	if (dec->type == FRAME_NONE) {
+		memcpy(text, data, len);
+		return len;
+	}
+
+	while (i < len) {
+		if (dec->state == FRAME_STATE_TEXT) {
+			p = memchr(in + i, dec->delim, len - i);
+			n = p ? (size_t)(p - (in + i)) : len - i;
+			memcpy(text + out, in + i, n);
+			out += n;
+			i += n;
+			if (p) {
+				frame_start(dec, dec->offset + i, false);
+				i++;
+			}
+			continue;
+		}
+
+		c = in[i];
+		if (c == dec->delim) {
+			// 0x7d 0x7e aborts an HDLC frame, a SLIP escape takes no END
+			if (dec->state == FRAME_STATE_ESCAPE)
+				dec->aborted = true;
+			out += frame_end(dec, dec->offset + i, text + out);
+			i++;
+			continue;
+		}
+
+		/*
+		 * Too long for a frame: text, and this byte is looked at again as
+		 * such. After a shared delimiter it was text following a frame.
+		 */
+		if (dec->raw_len == FRAME_MAX_LEN) {
+			if (dec->raw_open)
+				dec->overflows++;
+			out += frame_reject(dec, text + out);
+			continue;
+		}
+		dec->raw[dec->raw_len++] = c;
+
+		switch (dec->type) {
+		case FRAME_COBS:
+			frame_cobs(dec, c);
+			break;
+		case FRAME_SLIP:
+			frame_slip(dec, c);
+			break;
+		case FRAME_HDLC:
+			frame_hdlc(dec, c);
+			break;
+		}
+		i++;
+	}
+	dec->offset += len;
+
+	return out;
+}
+
+/*
+ * Give an open candidate back to text, e.g. when the port went quiet before
+ * it closed. Returns the number of bytes copied to text, at most
+ * FRAME_MAX_LEN.
+ */
+size_t frame_flush(struct frame_decoder *dec, char *text)
+{
+	if (dec->state == FRAME_STATE_TEXT)
+		return 0;
+
+	return frame_reject(dec, text);
+}
+
+/*
+ * Set up the sink without touching the target: frames decoded before
+ * frame_sink_attach() are buffered for a file and dropped for UDP.
+ */
+int frame_sink_init(struct frame_sink *sink, const char *target,
+		    const char *port)
+{
+	sink->udp = strncmp(target, "udp:", 4) == 0;
+	sink->sock = -1;
+	sink->rec.fd = -1;
+	sink->rec.buf = NULL;
+	sink->sent = 0;
+	sink->dropped = 0;
+
+	if (sink->udp)
+		return 0;
+	return record_init(&sink->rec, RECORD_BINARY, port);
+}
+
+/*
+ * Open the target: a connected UDP socket, or a record target. Returns the
+ * fd or a negative error. May block on name resolution or the file system.
+ */
+int frame_sink_connect(const char *target, bool *close_fd)
+{
+	if (strncmp(target, "udp:", 4) != 0)
+		return record_target_open(target, close_fd);
+
+	*close_fd = true;
+
+	// udp:<host>:<port>
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_DGRAM,
+	};
+	struct addrinfo *res;
+	char host[256];
+	const char *service = strrchr(target + 4, ':');
+	int sock, ret;
+
+	if (service == NULL || (size_t)(service - (target + 4)) >= sizeof(host)) {
+		fprintf(stderr, "Error: Invalid frame target %s\n", target);
+		return -EINVAL;
+	}
+	memcpy(host, target + 4, service - (target + 4));
+	host[service - (target + 4)] = '\0';
+
+	ret = getaddrinfo(host, service + 1, &hints, &res);
+	if (ret) {
+		fprintf(stderr, "Error: Failed to resolve %s: %s\n",
+			target, gai_strerror(ret));
+		return -EINVAL;
+	}
+
+	sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	if (sock < 0 || connect(sock, res->ai_addr, res->ai_addrlen) < 0) {
+		ret = -errno;
+		fprintf(stderr, "Error: Failed to connect to %s: %s (%d)\n",
+			target, strerror(errno), errno);
+		if (sock >= 0)
+			close(sock);
+		freeaddrinfo(res);
+		return ret;
+	}
+	freeaddrinfo(res);
+
+	return sock;
+}
+
+void frame_sink_attach(struct frame_sink *sink, int fd, bool close_fd)
+{
+	if (sink->udp) {
+		sink->sock = fd;
+		return;
+	}
+	sink->rec.fd = fd;
+	sink->rec.close_fd = close_fd;
+	record_flush(&sink->rec);
+}
+
+int frame_sink_open(struct frame_sink *sink, const char *target,
+		    const char *port)
+{
+	bool close_fd;
+	int ret;
+
+	ret = frame_sink_init(sink, target, port);
+	if (ret)
+		return ret;
+
+	ret = frame_sink_connect(target, &close_fd);
+	if (ret < 0)
+		return ret;
+	frame_sink_attach(sink, ret, close_fd);
+
+	return 0;
+}
+
+void frame_sink_write(const u8 *data, size_t len, u64 offset, void *ctx)
+{
+	struct frame_sink *sink = ctx;
+
+	if (sink->udp) {
+		if (sink->sock < 0 || send(sink->sock, data, len, MSG_DONTWAIT) < 0)
+			sink->dropped++;
+		else
+			sink->sent++;
+		return;
+	}
+
+	if (record_write(&sink->rec, data, len, 0, offset, &sink->mono, &sink->wall))
+		sink->dropped++;
+	else
+		sink->sent++;
+}
+
+int frame_sink_flush(struct frame_sink *sink)
+{
+	if (sink->rec.buf)
+		return record_flush(&sink->rec);
+	return 0;
+}
+
+int frame_sink_close(struct frame_sink *sink)
+{
+	int ret = 0;
+
+	if (sink->rec.buf)
+		ret = record_close(&sink->rec);
+
+	if (sink->sock >= 0) {
+		ret = close(sink->sock);
+		sink->sock = -1;
+	}
+
+	return ret;
+}
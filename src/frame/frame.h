@@ -0,0 +1,100 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stddef.h>
+#include <time.h>
+#include "types.h"
+#include "record.h"
+
+#define FRAME_MAX_LEN			(64 * 1024)
+
+enum frame_type {
+	FRAME_NONE = 0,
+	FRAME_COBS,			// 0x00 delimited, COBS encoded
+	FRAME_SLIP,			// 0xC0 delimited, RFC 1055
+	FRAME_HDLC,			// 0x7E delimited, RFC 1662, FCS-16
+};
+
+enum frame_crc {
+	FRAME_CRC_NONE = 0,
+	FRAME_CRC16,			// CRC-16/X.25 appended little endian
+	FRAME_CRC32,			// CRC-32/ISO-HDLC appended little endian
+};
+
+typedef void (*frame_cb_t)(const u8 *data, size_t len, u64 offset, void *ctx);
+
+/*
+ * Streaming decoder for binary frames interleaved with text on the same
+ * port. A delimiter opens a candidate frame and the next one closes it; a
+ * closing delimiter also opens the next candidate, so frames may share one.
+ * A candidate that fails its check, is malformed or grows too long was text
+ * after all: its bytes as received are given back. The decoder keeps its
+ * state across read() boundaries and reassembles frames into fixed buffers,
+ * so nothing is allocated per frame.
+ */
+struct frame_decoder
+{
+	int type;
+	int crc;
+	int state;
+	u8 delim;
+	u8 cobs_code;			// code byte of the current COBS block
+	u8 cobs_left;			// data bytes left in the current COBS block
+	u32 crc_val;
+	size_t len;
+	bool aborted;
+	u64 offset;			// stream offset of the next input byte
+	u64 frame_offset;		// stream offset of the opening delimiter
+	frame_cb_t cb;
+	void *ctx;
+
+	u64 frames;
+	u64 crc_errors;
+	u64 overflows;
+	u64 aborts;			// malformed escape or COBS block
+
+	u8 buf[FRAME_MAX_LEN];		// the decoded frame
+	u8 raw[FRAME_MAX_LEN];		// the candidate as received
+	size_t raw_len;
+	size_t raw_open;		// 1 if raw starts with the opening delimiter
+};
+
+/*
+ * Destination of the decoded frames: a file in the binary record format of
+ * record.h, or one UDP datagram per frame. Datagrams are sent without
+ * blocking and dropped when the socket buffer is full.
+ */
+struct frame_sink
+{
+	struct record rec;
+	bool udp;
+	int sock;			// -1 until the target is connected
+	struct timespec mono;		// time of the read() being decoded
+	struct timespec wall;
+	u64 sent;
+	u64 dropped;
+};
+
+extern void frame_decoder_init(struct frame_decoder *dec, int type, int crc,
+			       frame_cb_t cb, void *ctx);
+extern size_t frame_decode(struct frame_decoder *dec, const char *data,
+			   size_t len, char *text);
+extern size_t frame_flush(struct frame_decoder *dec, char *text);
+
+// A candidate holds bytes that may turn out to be text
+static inline bool frame_pending(const struct frame_decoder *dec)
+{
+	return dec->raw_len > 0;
+}
+
+extern int frame_sink_init(struct frame_sink *sink, const char *target,
+			   const char *port);
+extern int frame_sink_connect(const char *target, bool *close_fd);
+extern void frame_sink_attach(struct frame_sink *sink, int fd, bool close_fd);
+extern int frame_sink_open(struct frame_sink *sink, const char *target,
+			   const char *port);
+extern void frame_sink_write(const u8 *data, size_t len, u64 offset, void *ctx);
+extern int frame_sink_flush(struct frame_sink *sink);
+extern int frame_sink_close(struct frame_sink *sink);
+
+#endif
@@ -0,0 +1,240 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "frame.h"
+
+/*
+ * Decoder cases: frames sharing a delimiter, frames split across reads and
+ * candidates that are given back to the text. Each input is decoded in one
+ * piece and one byte at a time, with the same result expected.
+ */
+
+#define TEST_FRAMES_MAX			(8)
+#define TEST_INPUT_MAX			(80 * 1024)
+
+struct result
+{
+	int frames;
+	u8 frame[TEST_FRAMES_MAX][64];
+	size_t frame_len[TEST_FRAMES_MAX];
+	u64 frame_offset[TEST_FRAMES_MAX];
+	char *text;
+	size_t text_len;
+};
+
+static struct frame_decoder dec;
+static char text_buf[TEST_INPUT_MAX + FRAME_MAX_LEN];
+static u8 input[TEST_INPUT_MAX];
+static int failures;
+
+static void frame_cb(const u8 *data, size_t len, u64 offset, void *ctx)
+{
+	struct result *r = ctx;
+
+	if (r->frames < TEST_FRAMES_MAX && len <= sizeof(r->frame[0])) {
+		memcpy(r->frame[r->frames], data, len);
+		r->frame_len[r->frames] = len;
+		r->frame_offset[r->frames] = offset;
+	}
+	r->frames++;
+}
+
+static void decode(struct result *r, int type, int crc, const u8 *in, size_t len,
+		   size_t chunk)
+{
+	size_t i, n, text_len;
+
+	memset(r, 0, sizeof(*r));
+	r->text = malloc(len + FRAME_MAX_LEN);
+	frame_decoder_init(&dec, type, crc, frame_cb, r);
+
+	for (i = 0; i < len; i += n) {
+		n = len - i < chunk ? len - i : chunk;
+		text_len = frame_decode(&dec, (const char *)in + i, n, text_buf);
+		memcpy(r->text + r->text_len, text_buf, text_len);
+		r->text_len += text_len;
+	}
+	r->text_len += frame_flush(&dec, r->text + r->text_len);
+}
+
+static void check(const char *name, bool ok)
+{
+	if (!ok) {
+		printf("FAIL %s\n", name);
+		failures++;
+	}
+}
+
+/*
+ * Decode in one piece and byte by byte. The expected frames are given as
+ * (payload, length) pairs.
+ */
+static void run(const char *name, int type, int crc, const u8 *in, size_t len,
+		const void *text, size_t text_len, int frames, ...)
+{
+	static const size_t chunks[] = { TEST_INPUT_MAX, 1, 3 };
+	struct result r;
+	char what[128];
+	va_list ap;
+
+	for (size_t c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++) {
+		decode(&r, type, crc, in, len, chunks[c]);
+
+		snprintf(what, sizeof(what), "%s (%zu byte reads): frames", name, chunks[c]);
+		check(what, r.frames == frames);
+
+		va_start(ap, frames);
+		for (int i = 0; i < frames && i < r.frames; i++) {
+			const u8 *p = va_arg(ap, const u8 *);
+			size_t n = va_arg(ap, size_t);
+
+			snprintf(what, sizeof(what), "%s (%zu byte reads): frame %d", name,
+				 chunks[c], i);
+			check(what, r.frame_len[i] == n && memcmp(r.frame[i], p, n) == 0);
+		}
+		va_end(ap);
+
+		snprintf(what, sizeof(what), "%s (%zu byte reads): text", name, chunks[c]);
+		check(what, r.text_len == text_len && memcmp(r.text, text, text_len) == 0);
+		free(r.text);
+	}
+}
+
+static u16 crc16(const u8 *p, size_t len)
+{
+	u16 crc = 0xffff;
+
+	while (len--) {
+		crc ^= *p++;
+		for (int k = 0; k < 8; k++)
+			crc = (crc & 1) ? (crc >> 1) ^ 0x8408 : crc >> 1;
+	}
+	return ~crc;
+}
+
+// A flag, the payload and its FCS escaped, no closing flag
+static size_t hdlc_frame(u8 *out, const u8 *payload, size_t len)
+{
+	u8 buf[64];
+	size_t n = 0;
+	u16 fcs;
+
+	memcpy(buf, payload, len);
+	fcs = crc16(payload, len);
+	buf[len++] = fcs & 0xff;
+	buf[len++] = fcs >> 8;
+
+	out[n++] = 0x7e;
+	for (size_t i = 0; i < len; i++) {
+		if (buf[i] == 0x7e || buf[i] == 0x7d) {
+			out[n++] = 0x7d;
+			out[n++] = buf[i] ^ 0x20;
+		} else {
+			out[n++] = buf[i];
+		}
+	}
+	return n;
+}
+
+static void test_slip(void)
+{
+	static const u8 in[] = "hi\n\xc0\x01\x02\x03\xc0\xc0\x04\x05\x06\xc0ok\n";
+	static const u8 mid[] = "\xc0" "AB\xc0hello\n\xc0" "CD\xc0";
+	static const u8 esc[] = "\xc0\xc0\xdb\xdc\x01\xdb\xdd\xc0" "a\n";
+	static const u8 bad[] = "x\xc0\x01\xdb\x02\xc0y\n";
+
+	run("slip back to back", FRAME_SLIP, FRAME_CRC_NONE, in, sizeof(in) - 1,
+	    "hi\nok\n", 6, 2, "\x01\x02\x03", (size_t)3, "\x04\x05\x06", (size_t)3);
+	// Without a CRC the END closing a frame does not open the next one
+	run("slip text between frames", FRAME_SLIP, FRAME_CRC_NONE, mid, sizeof(mid) - 1,
+	    "hello\n", 6, 2, "AB", (size_t)2, "CD", (size_t)2);
+	run("slip escapes, repeated END", FRAME_SLIP, FRAME_CRC_NONE, esc, sizeof(esc) - 1,
+	    "a\n", 2, 1, "\xc0\x01\xdb", (size_t)3);
+	run("slip bad escape", FRAME_SLIP, FRAME_CRC_NONE, bad, sizeof(bad) - 1,
+	    bad, sizeof(bad) - 1, 0);
+}
+
+static void test_hdlc(void)
+{
+	static const u8 shell[] = "cd ~/work && ls ~/log\n";
+	static const u8 p1[] = { 0x01, 0x7e, 0x02 };
+	static const u8 p2[] = { 0x7d, 0x03 };
+	size_t n, bad_len;
+
+	run("hdlc text with flags", FRAME_HDLC, FRAME_CRC_NONE, shell, sizeof(shell) - 1,
+	    shell, sizeof(shell) - 1, 0);
+	if (dec.crc_errors != 1)
+		check("hdlc text with flags: crc errors", false);
+
+	// Text, two frames sharing a flag, text
+	memcpy(input, "boot\n", 5);
+	n = 5;
+	n += hdlc_frame(input + n, p1, sizeof(p1));
+	n += hdlc_frame(input + n, p2, sizeof(p2));
+	input[n++] = 0x7e;
+	memcpy(input + n, "ok\n", 3);
+	n += 3;
+	run("hdlc shared flag", FRAME_HDLC, FRAME_CRC_NONE, input, n,
+	    "boot\nok\n", 8, 2, p1, sizeof(p1), p2, sizeof(p2));
+
+	// The same with the first frame corrupted: its bytes come back as text
+	memcpy(input, "boot\n", 5);
+	n = 5;
+	bad_len = hdlc_frame(input + n, p1, sizeof(p1));
+	input[n + 1] ^= 0x40;
+	n += bad_len;
+	n += hdlc_frame(input + n, p2, sizeof(p2));
+	input[n++] = 0x7e;
+	run("hdlc bad crc", FRAME_HDLC, FRAME_CRC_NONE, input, n,
+	    input, 5 + bad_len, 1, p2, sizeof(p2));
+
+	// Text after a frame waits on the shared flag, but is no overflow
+	n = hdlc_frame(input, p1, sizeof(p1));
+	input[n++] = 0x7e;
+	bad_len = FRAME_MAX_LEN + 100;
+	memset(input + n, 'x', bad_len);
+	run("hdlc long text after a frame", FRAME_HDLC, FRAME_CRC_NONE, input, n + bad_len,
+	    input + n, bad_len, 1, p1, sizeof(p1));
+	if (dec.overflows != 0)
+		check("hdlc long text after a frame: overflows", false);
+}
+
+static void test_cobs(void)
+{
+	static const u8 in[] = { 'a', '\n', 0x00, 0x02, 0x11, 0x02, 0x22, 0x00,
+				 0x00, 0x01, 0x01, 0x00, 'b', '\n' };
+	static const u8 cut[] = { 'a', 0x00, 0x05, 0x11, 0x22, 0x00, 'b' };
+
+	run("cobs back to back", FRAME_COBS, FRAME_CRC_NONE, in, sizeof(in),
+	    "a\nb\n", 4, 2, "\x11\x00\x22", (size_t)3, "\x00", (size_t)1);
+	run("cobs cut block", FRAME_COBS, FRAME_CRC_NONE, cut, sizeof(cut),
+	    cut, sizeof(cut), 0);
+}
+
+static void test_overflow(void)
+{
+	size_t n = FRAME_MAX_LEN + 100;
+
+	input[0] = 0xc0;
+	memset(input + 1, 'x', n - 1);
+	run("slip overflow", FRAME_SLIP, FRAME_CRC_NONE, input, n, input, n, 0);
+	if (dec.overflows != 1)
+		check("slip overflow: overflows", false);
+}
+
+int main(void)
+{
+	test_slip();
+	test_hdlc();
+	test_cobs();
+	test_overflow();
+
+	if (failures) {
+		printf("%d checks failed\n", failures);
+		return EXIT_FAILURE;
+	}
+	printf("All frame decoder checks passed\n");
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "hexdump.h"
+
+// marker, offset, hex columns, ASCII column
+#define HEXDUMP_ROW_MAX			(2 + 10 + 2 + HEXDUMP_ROW_BYTES * 3 + 1 + 2 + HEXDUMP_ROW_BYTES + 2)
+
+static const char hex_digits[] = "0123456789abcdef";
+
+// Two hex digits and the ASCII column of every byte value
+static char hex_pair[256][2];
+static char ascii_map[256];
+static bool tables_ready;
+
+static char out_buf[HEXDUMP_BUF_SIZE];
+
+static void hexdump_init_tables(void)
+{
+	for (int c = 0; c < 256; c++) {
+		hex_pair[c][0] = hex_digits[c >> 4];
+		hex_pair[c][1] = hex_digits[c & 0xf];
+		ascii_map[c] = (c >= 0x20 && c < 0x7f) ? c : '.';
+	}
+	tables_ready = true;
+}
+
+void hexdump_init(struct hexdump *hd, FILE *fp, char marker)
+{
+	if (!tables_ready)
+		hexdump_init_tables();
+
+	hd->fp = fp;
+	hd->marker = marker;
+	hd->offset = 0;
+}
+
+static char *hexdump_row(char *p, char marker, u64 offset, const u8 *s, size_t n)
+{
+	size_t i;
+
+	*p++ = marker;
+	*p++ = ' ';
+	for (int shift = 36; shift >= 0; shift -= 4)
+		*p++ = hex_digits[(offset >> shift) & 0xf];
+	*p++ = ' ';
+	*p++ = ' ';
+
+	for (i = 0; i < n; i++) {
+		if (i == HEXDUMP_ROW_BYTES / 2)
+			*p++ = ' ';
+		memcpy(p, hex_pair[s[i]], 2);
+		p[2] = ' ';
+		p += 3;
+	}
+
+	// Pad a short row so the ASCII column stays aligned
+	if (n < HEXDUMP_ROW_BYTES) {
+		size_t pad = (HEXDUMP_ROW_BYTES - n) * 3 + (n <= HEXDUMP_ROW_BYTES / 2);
+		memset(p, ' ', pad);
+		p += pad;
+	}
+
+	*p++ = ' ';
+	*p++ = '|';
+	for (i = 0; i < n; i++)
+		*p++ = ascii_map[s[i]];
+	*p++ = '|';
+	*p++ = '\n';
+
+	return p;
+}
+
+void hexdump_write(struct hexdump *hd, const void *data, size_t len)
+{
+	const u8 *s = data;
+	char *p = out_buf;
+	size_t n;
+
+	while (len) {
+		if (p + HEXDUMP_ROW_MAX > out_buf + sizeof(out_buf)) {
+			fwrite(out_buf, 1, p - out_buf, hd->fp);
+			p = out_buf;
+		}
+
+		n = len < HEXDUMP_ROW_BYTES ? len : HEXDUMP_ROW_BYTES;
+		p = hexdump_row(p, hd->marker, hd->offset, s, n);
+		hd->offset += n;
+		s += n;
+		len -= n;
+	}
+
+	fwrite(out_buf, 1, p - out_buf, hd->fp);
+}
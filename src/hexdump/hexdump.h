@@ -0,0 +1,30 @@
+#ifndef HEXDUMP_H
+#define HEXDUMP_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include "types.h"
+
+#define HEXDUMP_BUF_SIZE		(64 * 1024)
+#define HEXDUMP_ROW_BYTES		(16)
+
+#define HEXDUMP_RX			'<'
+#define HEXDUMP_TX			'>'
+
+/*
+ * One direction of the hex view. Rows look like
+ *   < 0000000010  48 65 6c 6c 6f 0a 00 01  02 03 04 05 06 07 08 09  |Hello...........|
+ * Every call starts a new row so that RX and TX rows never mix; the offset
+ * keeps counting across calls.
+ */
+struct hexdump
+{
+	FILE *fp;
+	char marker;
+	u64 offset;
+};
+
+extern void hexdump_init(struct hexdump *hd, FILE *fp, char marker);
+extern void hexdump_write(struct hexdump *hd, const void *data, size_t len);
+
+#endif
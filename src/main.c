@@ -11,12 +11,24 @@
 #include <libgen.h>
 #include <limits.h>
 #include <pwd.h>
+#include <getopt.h>
+#include <pthread.h>
 #include <sys/types.h>
 
 #include "global.h"
 #include "types.h"
 #include "list.h"
 #include "serial_port.h"
+#include "capture.h"
+#include "record.h"
+#include "frame.h"
+#include "hexdump.h"
+#include "storm.h"
+#include "filter.h"
+#include "trace.h"
+#include "shmring.h"
+#include "rtcap.h"
+#include "line.h"
 
 #define ATTY_VERSION			"1.1.0"
 
@@ -27,15 +39,265 @@
 #define DEFAULT_SERIAL_PORT		"/dev/ttyUSB0"
 #define DEFAULT_BAUD_RATE		(115200)
 #define DEFAULT_FILE_SIZE_LIMIT		(1024 * 1024 * 1024)
+#define DEFAULT_MIN_FREE		(64 * MB)
+#define WATCHDOG_INTERVAL_S		(1)
 #define DATA_IN_BUF_SIZE		(8192)
+#define FRAME_TEXT_SIZE			(RT_READ_MAX + FRAME_MAX_LEN)	// the largest chunk
 #define DATA_OUT_BUF_SIZE		(512)
-#define NFDS				(2)
 #define POLL_TIMEOUT_MS			(-1)
+#define LINE_IDLE_MS			(100)
+#define STORM_TICK_MS			(1000)
 #define NON_BLOCK_DELAY_MS		(100000)
 #define FILE_NAME_MAX			(256)
 #define DEV_NAME_MAX			(256)
 
+enum {
+	FD_SERIAL = 0,
+	FD_STDIN,
+	FD_WATCHDOG,
+	FD_LOG_SETUP,
+	FD_RT,
+	NFDS
+};
+
+enum {
+	OPT_LIMIT_MODE = 256,
+	OPT_ROTATE_KEEP,
+	OPT_KEEP_HEAD,
+	OPT_KEEP_TAIL,
+	OPT_MIN_FREE,
+	OPT_RECORD,
+	OPT_RECORD_FORMAT,
+	OPT_FRAME,
+	OPT_FRAME_CRC,
+	OPT_FRAME_OUT,
+	OPT_HEX,
+	OPT_HEX_TX,
+	OPT_DEDUP,
+	OPT_DEDUP_FILE,
+	OPT_RATE_LIMIT,
+	OPT_CONSOLE_FILTER,
+	OPT_FILE_FILTER,
+	OPT_RECORD_FILTER,
+	OPT_TRACE,
+	OPT_SHM,
+	OPT_SHM_SIZE,
+	OPT_RT,
+	OPT_RT_PRIO,
+	OPT_RT_LOCK,
+};
+
+// Where a line went, for the storm summaries about it
+enum {
+	SINK_CONSOLE = 1 << 0,
+	SINK_FILE = 1 << 1,
+};
+
+const struct option long_options[] = {
+	{ "limit-mode",		required_argument,	NULL, OPT_LIMIT_MODE },
+	{ "rotate-keep",	required_argument,	NULL, OPT_ROTATE_KEEP },
+	{ "keep-head",		required_argument,	NULL, OPT_KEEP_HEAD },
+	{ "keep-tail",		required_argument,	NULL, OPT_KEEP_TAIL },
+	{ "min-free",		required_argument,	NULL, OPT_MIN_FREE },
+	{ "record",		required_argument,	NULL, OPT_RECORD },
+	{ "record-format",	required_argument,	NULL, OPT_RECORD_FORMAT },
+	{ "frame",		required_argument,	NULL, OPT_FRAME },
+	{ "frame-crc",		required_argument,	NULL, OPT_FRAME_CRC },
+	{ "frame-out",		required_argument,	NULL, OPT_FRAME_OUT },
+	{ "hex",		no_argument,		NULL, OPT_HEX },
+	{ "hex-tx",		no_argument,		NULL, OPT_HEX_TX },
+	{ "dedup",		optional_argument,	NULL, OPT_DEDUP },
+	{ "dedup-file",		no_argument,		NULL, OPT_DEDUP_FILE },
+	{ "rate-limit",		required_argument,	NULL, OPT_RATE_LIMIT },
+	{ "console-filter",	required_argument,	NULL, OPT_CONSOLE_FILTER },
+	{ "file-filter",	required_argument,	NULL, OPT_FILE_FILTER },
+	{ "record-filter",	required_argument,	NULL, OPT_RECORD_FILTER },
+	{ "trace",		required_argument,	NULL, OPT_TRACE },
+	{ "shm",		optional_argument,	NULL, OPT_SHM },
+	{ "shm-size",		required_argument,	NULL, OPT_SHM_SIZE },
+	{ "rt",			optional_argument,	NULL, OPT_RT },
+	{ "rt-prio",		required_argument,	NULL, OPT_RT_PRIO },
+	{ "rt-lock",		no_argument,		NULL, OPT_RT_LOCK },
+	{ NULL,			0,			NULL, 0 }
+};
+
+/*
+ * The log file, the record and frame targets and the shared memory ring are
+ * set up on a helper thread so that the serial port is read from the first
+ * moment. It notifies the main loop through a pipe.
+ */
+struct log_setup {
+	pthread_t thread;
+	struct serial_cfg *cfg;
+	struct capture *cap;
+	char *file_name;
+	time_t start_time;
+	char shm_name[SHMRING_NAME_MAX];
+	struct shmring ring;
+	int rec_fd;
+	bool rec_close;
+	int frame_fd;
+	bool frame_close;
+	int pipe_fd[2];
+	int ret;
+	bool running;
+};
+
+/*
+ * A destination of the received text, the console or the log file. Each one
+ * keeps track of its line start for the -t timestamps.
+ */
+struct output {
+	int (*write)(void *ctx, const char *s, size_t len);
+	void *ctx;
+	bool new_line;
+};
+
+/*
+ * What has been received so far, whichever thread read it.
+ */
+struct rx_state {
+	u64 bytes;
+	u64 offset;			// of the text, frames taken out
+	struct timespec first_ts;
+};
+
 struct pollfd fds[NFDS];
+int serial_fd = -1;
+struct output console_out, file_out;
+struct line out_line;
+struct storm storm;
+struct filter_set filters;
+struct filter console_filter, file_filter, record_filter;
+bool line_continued;
+bool line_console, line_file, line_record;
+int line_ret;
+struct record rec = { .fd = -1 };		// buffering from the start, fd set later
+struct shmring shm_ring;
+struct frame_decoder frame_dec;
+struct frame_sink frame_sink = { .sock = -1, .rec = { .fd = -1 } };
+char frame_text[FRAME_TEXT_SIZE];
+struct rt_reader rt;
+struct hexdump hex_rx, hex_tx;
+
+void usage(const char *prog)
+{
+	printf("Usage: %s [options]\n"
+		"  -c                 Map CR to NL on input\n"
+		"  -d <dev>           Serial port (default: %s)\n"
+		"  -h                 Show this help\n"
+		"  -l                 Map NL to CR-NL on output\n"
+		"  -n                 NL performs CR function on output\n"
+		"  -o <file>          Save log to <file>\n"
+		"  -r <baud>          Baud rate (default: %d)\n"
+		"  -s                 Save log to ~/log/atty-YYYYMMDD-HHMMSS.txt\n"
+		"  -t                 Prefix every line with a timestamp\n"
+		"  -v                 Show version\n"
+		"  -z[size]           Log file size limit (default: %d)\n"
+		"  --limit-mode=<m>   What to do at the size limit: stop, rotate, head-tail\n"
+		"  --rotate-keep=<n>  Rotated files to keep (default: all)\n"
+		"  --keep-head=<size> head-tail: bytes kept from the start\n"
+		"  --keep-tail=<size> head-tail: bytes kept from the end\n"
+		"  --min-free=<size>  Suspend the log below this free space (default: %d, 0: off)\n"
+		"  --record=<target>  Write one record per received line to a file,\n"
+		"                     '-' for stdout (the console moves to stderr) or 'fd:<n>'\n"
+		"  --record-format=<f> Record format: json (default), bin\n"
+		"  --frame=<type>     Decode binary frames between the text: cobs, slip, hdlc\n"
+		"  --frame-crc=<crc>  Frame check: none (default), crc16, crc32\n"
+		"  --frame-out=<target> Write decoded frames to a file, '-' for stdout (the\n"
+		"                     console moves to stderr), 'fd:<n>' or 'udp:<host>:<port>'\n"
+		"  --hex              Show received bytes as offset/hex/ASCII rows\n"
+		"  --hex-tx           Show transmitted bytes in the hex view too\n"
+		"  --dedup[=<secs>]   Collapse repeated lines on the console, consecutive\n"
+		"                     ones or any within <secs> seconds\n"
+		"  --dedup-file       Collapse repeated lines in the log file too\n"
+		"  --rate-limit=<n>   Show at most <n> lines per second on the console\n"
+		"  --console-filter=[+|-]<pattern>\n"
+		"  --file-filter=[+|-]<pattern>\n"
+		"  --record-filter=[+|-]<pattern>\n"
+		"                     Only pass lines matching a '+' pattern, if any, and\n"
+		"                     no '-' pattern to the sink. <pattern> is a substring\n"
+		"                     or a /regex/; each option may be repeated\n"
+		"  --trace=<file>     Trace the event loop; the trace is written in Chrome\n"
+		"                     trace format on SIGUSR1 and on exit\n"
+		"  --shm[=<name>]     Publish received chunks to the shared memory ring\n"
+		"                     /dev/shm/<name> (default: atty-<port name>)\n"
+		"  --shm-size=<size>  Size of the ring (default: %dM)\n"
+		"  --rt[=<cpu>]       Read the port on a real-time thread, pinned to <cpu>,\n"
+		"                     and report the worst read latency on exit\n"
+		"  --rt-prio=<1-99>   SCHED_FIFO priority of the reader thread\n"
+		"  --rt-lock          Lock all memory to keep page faults off the reader\n"
+		"Sizes accept a K, M or G suffix.\n",
+		prog, DEFAULT_SERIAL_PORT, DEFAULT_BAUD_RATE, DEFAULT_FILE_SIZE_LIMIT,
+		DEFAULT_MIN_FREE, SHMRING_DEFAULT_SIZE / MB);
+}
+
+// A record or frame target that is the stdout of atty
+bool is_stdout_target(const char *target)
+{
+	char *end;
+
+	if (strcmp(target, "-") == 0)
+		return true;
+	if (strncmp(target, "fd:", 3) != 0)
+		return false;
+	return strtol(target + 3, &end, 0) == STDOUT_FILENO && *end == '\0';
+}
+
+/*
+ * Records on stdout must not be mixed with the console text: they get the
+ * stdout atty was started with and everything printed, the status messages
+ * included, goes to stderr instead. Returns the record target to use.
+ */
+char *stdout_to_records(char *target, size_t size)
+{
+	int fd;
+
+	// Not flushed before: what the option parsing printed goes to stderr too
+	fd = dup(STDOUT_FILENO);
+	if (fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+		fprintf(stderr, "Error: Failed to move the console to stderr: %s (%d)\n",
+			strerror(errno), errno);
+		exit(EXIT_FAILURE);
+	}
+	snprintf(target, size, "fd:%d", fd);
+
+	return target;
+}
+
+long parse_size(const char *s)
+{
+	char *end;
+	long size;
+
+	errno = 0;
+	size = strtol(s, &end, 0);
+	if (errno == ERANGE || end == s)
+		return -1;
+
+	switch (*end) {
+	case 'k':
+	case 'K':
+		size *= KB;
+		end++;
+		break;
+	case 'm':
+	case 'M':
+		size *= MB;
+		end++;
+		break;
+	case 'g':
+	case 'G':
+		size *= GB;
+		end++;
+		break;
+	}
+
+	if (*end != '\0')
+		return -1;
+
+	return size;
+}
 
 void clear_screen(void) {
     printf("\033[2J\033[H");
@@ -47,7 +309,7 @@ void sigint_handler(int sig) {
 	printf("\nsigint_handler: %d\n", sig);
 	#endif
 	char etx = 3;
-	ssize_t bytes_written = write(fds[0].fd, &etx, sizeof(etx));
+	ssize_t bytes_written = write(serial_fd, &etx, sizeof(etx));
 	#if (CONFIG_MAIN_DEBUG)
 	if (bytes_written > 0)
 		printf("bytes_written: %ld\n", bytes_written);
@@ -58,12 +320,18 @@ void sigint_handler(int sig) {
 	}
 }
 
-const char *get_home_dir(bool alloc)
+/*
+ * Runs on the log setup thread, so the reentrant getpwnam_r() keeps off the
+ * static passwd entry of libc. The home directory is copied to buf.
+ */
+int get_home_dir(char *buf, size_t size)
 {
 	const char *user, *home;
+	struct passwd pw_ent, *pw = NULL;
+	char pw_buf[1024];
 
 	if ((user = getenv("SUDO_USER")) != NULL) {
-		const struct passwd *pw = getpwnam(user);
+		getpwnam_r(user, &pw_ent, pw_buf, sizeof(pw_buf), &pw);
 		if (pw == NULL) {
 			fprintf(stderr, "Error: Failed to get passwd entry for user: %s\n",
 				user);
@@ -81,16 +349,10 @@ const char *get_home_dir(bool alloc)
 		fprintf(stderr, "Error: HOME environment variable is not set\n");
 exit:
 	if (home == NULL)
-		return NULL;
+		return -ENOENT;
 
-	if (alloc) {
-		char *dup = strdup(home);
-		if (dup == NULL)
-			fprintf(stderr, "Error: Failed to duplicate string: %s (%d)\n",
-				strerror(errno), errno);
-		return dup;
-	}
-	return home;
+	snprintf(buf, size, "%s", home);
+	return 0;
 }
 
 int create_parent_dirs(const char *path)
@@ -129,25 +391,498 @@ int create_parent_dirs(const char *path)
 	return 0;
 }
 
+// Open the log file, with its name built from the start time if not given
+int log_setup_file(struct log_setup *setup)
+{
+	char *file_name = setup->file_name;
+	int ret;
+
+	if (!setup->cfg->output_file) {
+		char home[PATH_MAX];
+		struct tm local;
+
+		if (get_home_dir(home, sizeof(home))) {
+			fprintf(stderr, "Error: Failed to get home directory\n");
+			return -ENOENT;
+		}
+
+		// The main loop may be formatting -t timestamps meanwhile
+		localtime_r(&setup->start_time, &local);
+		sprintf(file_name, "%s/log/atty-%04d%02d%02d-%02d%02d%02d.txt",
+			home,
+			local.tm_year + 1900,
+			local.tm_mon + 1,
+			local.tm_mday,
+			local.tm_hour,
+			local.tm_min,
+			local.tm_sec);
+	}
+
+	ret = create_parent_dirs(file_name);
+	if (ret) {
+		fprintf(stderr, "Error: Failed to create the path of '%s'\n", file_name);
+		return ret;
+	}
+
+	return capture_open(setup->cap, file_name);
+}
+
+void *log_setup_thread(void *arg)
+{
+	struct log_setup *setup = arg;
+	struct serial_cfg *cfg = setup->cfg;
+	u64 t;
+	int ret = 0;
+
+	trace_thread("log setup", TRACE_THREAD_EVENTS);
+	t = trace_begin();
+
+	if (cfg->save) {
+		ret = log_setup_file(setup);
+		if (ret)
+			goto exit;
+	}
+
+	if (cfg->record) {
+		ret = record_target_open(cfg->record, &setup->rec_close);
+		if (ret < 0)
+			goto exit;
+		setup->rec_fd = ret;
+		if (setup->rec_close)
+			capture_chown(cfg->record, false);
+	}
+
+	if (cfg->frame_type != FRAME_NONE && cfg->frame_out) {
+		ret = frame_sink_connect(cfg->frame_out, &setup->frame_close);
+		if (ret < 0)
+			goto exit;
+		setup->frame_fd = ret;
+		if (setup->frame_close && strncmp(cfg->frame_out, "udp:", 4) != 0)
+			capture_chown(cfg->frame_out, false);
+	}
+
+	if (cfg->shm) {
+		ret = shmring_create(&setup->ring, setup->shm_name, cfg->shm_size,
+				     cfg->dev_name);
+		if (ret)
+			goto exit;
+	}
+	ret = 0;
+exit:
+	trace_end(TRACE_LOG_SETUP, t, 0);
+	setup->ret = ret;
+	if (write(setup->pipe_fd[1], "", 1) < 0)
+		fprintf(stderr, "Error: Failed to notify the log setup: %s (%d)\n",
+			strerror(errno), errno);
+
+	return NULL;
+}
+
+int log_setup_start(struct log_setup *setup)
+{
+	int ret;
+
+	if (pipe(setup->pipe_fd) < 0) {
+		fprintf(stderr, "Error: Failed to create a pipe: %s (%d)\n",
+			strerror(errno), errno);
+		return -errno;
+	}
+
+	ret = pthread_create(&setup->thread, NULL, log_setup_thread, setup);
+	if (ret) {
+		fprintf(stderr, "Error: Failed to create the log setup thread: %s (%d)\n",
+			strerror(ret), ret);
+		close(setup->pipe_fd[0]);
+		close(setup->pipe_fd[1]);
+		return -ret;
+	}
+	setup->running = true;
+
+	return setup->pipe_fd[0];
+}
+
+/*
+ * Join the helper thread, hand what it opened over to the main loop and
+ * backfill the outputs with what was read meanwhile.
+ */
+int log_setup_finish(struct log_setup *setup)
+{
+	struct serial_cfg *cfg = setup->cfg;
+	char c;
+
+	if (!setup->running)
+		return 0;
+
+	pthread_join(setup->thread, NULL);
+	setup->running = false;
+	if (read(setup->pipe_fd[0], &c, 1) < 0)
+		c = 0;
+	close(setup->pipe_fd[0]);
+	close(setup->pipe_fd[1]);
+
+	// Attached even after a failure so that the exit path closes them
+	if (setup->rec_fd >= 0) {
+		rec.fd = setup->rec_fd;
+		rec.close_fd = setup->rec_close;
+		record_flush(&rec);
+	}
+	if (setup->frame_fd >= 0)
+		frame_sink_attach(&frame_sink, setup->frame_fd, setup->frame_close);
+	if (setup->ring.hdr) {
+		shm_ring = setup->ring;
+		printf("Publish to the shared memory ring '/dev/shm%s'\n", shm_ring.name);
+	}
+
+	if (setup->ret) {
+		if (cfg->save)
+			capture_backlog_free(setup->cap);
+		return setup->ret;
+	}
+
+	if (!cfg->save)
+		return 0;
+
+	printf("Save log to the file '%s'\n", setup->file_name);
+
+	return capture_backlog_flush(setup->cap);
+}
+
+double elapsed_ms(const struct timespec *from, const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000.0 +
+		(to->tv_nsec - from->tv_nsec) / 1000000.0;
+}
+
+int console_write(void *ctx, const char *s, size_t len)
+{
+	u64 t = trace_begin();
+
+	fwrite(s, 1, len, stdout);
+	trace_end(TRACE_CONSOLE, t, len);
+
+	return 0;
+}
+
+int file_write(void *ctx, const char *s, size_t len)
+{
+	u64 t = trace_begin();
+	int ret;
+
+	ret = capture_write(ctx, s, len);
+	trace_end(TRACE_LOG, t, len);
+
+	return ret;
+}
+
+size_t format_timestamp(char *buf, size_t size, const struct timespec *ts)
+{
+	struct tm t;
+	size_t len;
+
+	// Convert seconds to local time format
+	localtime_r(&ts->tv_sec, &t);
+
+	// Format the time up to seconds: [YYYY-MM-DD HH:MM:SS
+	len = strftime(buf, size, "[%Y-%m-%d %H:%M:%S", &t);
+
+	// Append milliseconds (1 ms = 1,000,000 ns) and the closing bracket
+	len += snprintf(buf + len, size - len, ".%03d] ", (int)(ts->tv_nsec / 1000000));
+
+	return len;
+}
+
+/*
+ * Write text to one output. With -t, every line is prefixed by the time it
+ * was received and the data is written line by line.
+ */
+int output_write(struct serial_cfg *cfg, struct output *out, const char *data,
+		 size_t len, const struct timespec *wall)
+{
+	char time_str[64];
+	const char *nl;
+	size_t n;
+	int ret;
+
+	if (len == 0)
+		return 0;
+
+	if (!cfg->time) {
+		out->new_line = (data[len - 1] == '\n');
+		return out->write(out->ctx, data, len);
+	}
+
+	while (len) {
+		// If it is the start of a new line, print the timestamp
+		if (out->new_line) {
+			n = format_timestamp(time_str, sizeof(time_str), wall);
+			ret = out->write(out->ctx, time_str, n);
+			if (ret)
+				return ret;
+			out->new_line = false;
+		}
+
+		nl = memchr(data, '\n', len);
+		n = nl ? (size_t)(nl - data) + 1 : len;
+
+		ret = out->write(out->ctx, data, n);
+		if (ret)
+			return ret;
+
+		if (nl)
+			out->new_line = true;
+		data += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * Summaries of the storm suppression. A repeat summary goes to the sinks the
+ * line passed, to the log only with --dedup-file.
+ */
+void output_note(int kind, u32 sinks, const char *s, size_t len, void *arg)
+{
+	struct serial_cfg *cfg = arg;
+	struct timespec wall;
+	int ret;
+
+	clock_gettime(CLOCK_REALTIME, &wall);
+
+	if (kind != STORM_NOTE_REPEAT || (sinks & SINK_CONSOLE)) {
+		if (!console_out.new_line)
+			output_write(cfg, &console_out, "\n", 1, &wall);
+		output_write(cfg, &console_out, s, len, &wall);
+	}
+
+	if (cfg->save && cfg->dedup_file && kind == STORM_NOTE_REPEAT &&
+	    (sinks & SINK_FILE)) {
+		if (!file_out.new_line)
+			output_write(cfg, &file_out, "\n", 1, &wall);
+		ret = output_write(cfg, &file_out, s, len, &wall);
+		if (ret && line_ret == 0)
+			line_ret = ret;
+	}
+}
+
+/*
+ * Line stage: completed lines go through the storm suppression before they
+ * reach the console and, unless the log is kept lossless, the log file.
+ * Pieces of a partial line are passed on unchanged.
+ */
+void output_line(struct line *line, void *arg)
+{
+	struct serial_cfg *cfg = arg;
+	bool whole = !line->partial && !line_continued;
+	bool pass = true;
+	size_t n = line->len;
+	u64 match;
+	int ret;
+
+	// The filters see the first piece of a line, the rest of it follows
+	if (!line_continued && filters.patterns) {
+		if (n && line->buf[n - 1] == '\n')
+			n--;
+		if (n && line->buf[n - 1] == '\r')
+			n--;
+
+		match = filter_match(&filters, line->buf, n);
+		line_console = !cfg->hex && filter_pass(&console_filter, match);
+		line_file = filter_pass(&file_filter, match);
+		line_record = filter_pass(&record_filter, match);
+	}
+	line_continued = line->partial;
+
+	if (rec.buf && filter_active(&record_filter) && line_record)
+		record_line(line, &rec);
+
+	if (whole) {
+		// Lines no sink shows do not take part in the storm suppression
+		if (line_console || (cfg->dedup_file && line_file))
+			pass = storm_check(&storm, line->buf, line->len, line->wall.tv_sec,
+					   (line_console ? SINK_CONSOLE : 0) |
+					   (line_file ? SINK_FILE : 0),
+					   output_note, cfg);
+	} else {
+		storm_break(&storm, output_note, cfg);
+	}
+
+	if (cfg->save && line_file && (pass || !cfg->dedup_file)) {
+		ret = output_write(cfg, &file_out, line->buf, line->len, &line->wall);
+		if (ret && line_ret == 0)
+			line_ret = ret;
+	}
+
+	if (line_console && pass && storm_rate(&storm, line->wall.tv_sec, output_note, cfg))
+		output_write(cfg, &console_out, line->buf, line->len, &line->wall);
+}
+
+// Nothing was received for a while: pass on a partial line and due summaries
+int output_idle(struct serial_cfg *cfg, bool force)
+{
+	struct timespec now;
+	int ret;
+
+	line_flush(&out_line, output_line, cfg);
+	clock_gettime(CLOCK_REALTIME, &now);
+	storm_tick(&storm, now.tv_sec, force, output_note, cfg);
+	fflush(stdout);
+	if (rec.buf)
+		record_flush(&rec);
+
+	ret = line_ret;
+	line_ret = 0;
+	return ret;
+}
+
+/*
+ * Pass the received text to the console and the log file, through the line
+ * stage when one of its features is enabled.
+ */
+int output_data_in(struct serial_cfg *cfg, const char *data, size_t len,
+		   u64 offset, const struct timespec *mono,
+		   const struct timespec *wall)
+{
+	int ret;
+
+	// The hex view is the console, the line stage still serves the log and the records
+	if (cfg->hex) {
+		hexdump_write(&hex_rx, data, len);
+		if (!cfg->line_stage)
+			return cfg->save ? output_write(cfg, &file_out, data, len, wall) : 0;
+	}
+
+	if (cfg->line_stage) {
+		line_feed(&out_line, data, len, offset, mono, wall, output_line, cfg);
+		ret = line_ret;
+		line_ret = 0;
+		return ret;
+	}
+
+	output_write(cfg, &console_out, data, len, wall);
+	if (cfg->save)
+		return output_write(cfg, &file_out, data, len, wall);
+
+	return 0;
+}
+
+// The received text, frames taken out, to the console, the log and the records
+int handle_text(struct serial_cfg *cfg, struct rx_state *rx, const char *data,
+		size_t text_len, const struct timespec *mono,
+		const struct timespec *wall)
+{
+	int ret = 0;
+	u64 t;
+
+	#if (CONFIG_MAIN_DEBUG)
+	printf("text_len: %zu\n", text_len);
+	#else
+	t = trace_begin();
+	ret = output_data_in(cfg, data, text_len, rx->offset, mono, wall);
+	trace_end(TRACE_FORMAT, t, text_len);
+	if (ret == CAPTURE_LIMIT_REACHED)
+		return ret;
+	#endif
+	t = trace_begin();
+	fflush(stdout);
+	trace_end(TRACE_CONSOLE, t, 0);
+
+	// With a record filter the lines come from the line stage
+	if (rec.buf) {
+		t = trace_begin();
+		if (!filter_active(&record_filter))
+			record_feed(&rec, data, text_len, rx->offset, mono, wall);
+		record_flush(&rec);
+		trace_end(TRACE_RECORD, t, text_len);
+	}
+	rx->offset += text_len;
+
+	return ret;
+}
+
+/*
+ * Everything done with a received chunk, read here or queued by the RT
+ * reader.
+ */
+int handle_data_in(struct serial_cfg *cfg, struct rx_state *rx, char *data,
+		   size_t len, const struct timespec *mono,
+		   const struct timespec *wall)
+{
+	size_t text_len;
+	u64 t;
+
+	if (rx->bytes == 0)
+		rx->first_ts = *mono;
+	rx->bytes += len;
+
+	// Readers of the ring get the raw chunk, before any frame is taken out
+	if (shm_ring.hdr)
+		shmring_publish(&shm_ring, data, len, rx->bytes - len, mono);
+
+	// Binary frames are taken out, the text is copied to frame_text
+	text_len = len;
+	if (cfg->frame_type != FRAME_NONE) {
+		t = trace_begin();
+		frame_sink.mono = *mono;
+		frame_sink.wall = *wall;
+		text_len = frame_decode(&frame_dec, data, len, frame_text);
+		frame_sink_flush(&frame_sink);
+		trace_end(TRACE_FRAME, t, len);
+		data = frame_text;
+	}
+
+	return handle_text(cfg, rx, data, text_len, mono, wall);
+}
+
+// A frame still open when the port goes quiet was text after all
+int handle_frame_idle(struct serial_cfg *cfg, struct rx_state *rx)
+{
+	struct timespec mono, wall;
+	size_t len;
+
+	if (cfg->frame_type == FRAME_NONE || !frame_pending(&frame_dec))
+		return 0;
+
+	len = frame_flush(&frame_dec, frame_text);
+	clock_gettime(CLOCK_MONOTONIC, &mono);
+	clock_gettime(CLOCK_REALTIME, &wall);
+
+	return handle_text(cfg, rx, frame_text, len, &mono, &wall);
+}
+
 int main(int argc, char *argv[])
 {
+	struct timespec start_ts;
+	clock_gettime(CLOCK_MONOTONIC, &start_ts);
+
 	int ret;
-	FILE *fp = NULL;
+	struct log_setup setup = { .rec_fd = -1, .frame_fd = -1, .running = false };
+	struct capture cap = { .fp = NULL };
+	struct rx_state rx = { .bytes = 0 };
 	char *end;
 	size_t len;
 	ssize_t bytes_read, bytes_written;
-	ssize_t total_bytes_written = 0;
 	char data_in[DATA_IN_BUF_SIZE];
 	char data_out[DATA_OUT_BUF_SIZE];
 	char file_name[PATH_MAX + FILE_NAME_MAX];
 	char dev_name[DEV_NAME_MAX];
-	char default_log_dir[PATH_MAX];
+	char record_target[16], frame_target[16];
 	memcpy(dev_name, DEFAULT_SERIAL_PORT, sizeof(DEFAULT_SERIAL_PORT));
 
 	struct serial_cfg cfg = {
 		.dev_name 		= dev_name,
 		.baud_rate 		= DEFAULT_BAUD_RATE,
 		.file_size_limit	= 0,
+		.limit_mode		= CAPTURE_LIMIT_STOP,
+		.rotate_keep		= 0,
+		.head_size		= 0,
+		.tail_size		= 0,
+		.min_free		= DEFAULT_MIN_FREE,
+		.record			= NULL,
+		.record_format		= RECORD_JSON,
+		.frame_type		= FRAME_NONE,
+		.frame_crc		= FRAME_CRC_NONE,
+		.frame_out		= NULL,
 		.help 			= 0,
 		.output_file 		= 0,
 		.save 			= 0,
@@ -155,11 +890,27 @@ int main(int argc, char *argv[])
 		.onlret 		= 0,
 		.onlcr 			= 0,
 		.time			= 0,
+		.hex			= 0,
+		.hex_tx			= 0,
+		.dedup			= 0,
+		.dedup_file		= 0,
+		.dedup_window		= 0,
+		.rate_limit		= 0,
+		.line_stage		= 0,
+		.trace			= NULL,
+		.shm			= NULL,
+		.shm_size		= SHMRING_DEFAULT_SIZE,
+		.rt			= 0,
+		.rt_cpu			= -1,
+		.rt_prio		= 0,
+		.rt_lock		= 0,
 	};
+	struct filter *sink_filter;
 
 	int opt;
 	/* handle (optional) flags first */
-	while ((opt = getopt(argc, argv, "cd:hlno:r:stvz::")) != -1) {
+	while ((opt = getopt_long(argc, argv, "cd:hlno:r:stvz::",
+				  long_options, NULL)) != -1) {
 		#if (CONFIG_GETOPT_DEBUG)
 		printf("opt: %c,%d,%d\n", (char)opt, optind, argc);
 		#endif
@@ -207,28 +958,9 @@ int main(int argc, char *argv[])
 		case 's':
 			if (cfg.output_file)
 				break;
+			// The file name is built by the log setup thread
 			cfg.save = 1;
-			const char *home = get_home_dir(false);
-			if (home == NULL) {
-				fprintf(stderr, "Error: Failed to get home directory\n");
-				exit(EXIT_FAILURE);
-			}
-			len = sprintf(default_log_dir, "%s/log/", home);
-			default_log_dir[len] = '\0';
-			printf("default_log_dir[%ld]: %s\n", len, default_log_dir);
-
-			time_t t = time(NULL);
-			struct tm *local = localtime(&t);
-			len = sprintf(file_name, "%satty-%04d%02d%02d-%02d%02d%02d.txt",
-				default_log_dir,
-				local->tm_year + 1900,
-				local->tm_mon + 1,
-				local->tm_mday,
-				local->tm_hour,
-				local->tm_min,
-				local->tm_sec);
-			file_name[len] = '\0';
-			printf("output_file[%ld]: %s\n", len, file_name);
+			setup.start_time = time(NULL);
 			break;
 		case 't':
 			cfg.time = 1;
@@ -239,16 +971,171 @@ int main(int argc, char *argv[])
 				printf("Using default file size limit: %ld\n",
 					cfg.file_size_limit);
 			} else {
-				cfg.file_size_limit = strtol(optarg, &end, 0);
-				if (cfg.file_size_limit <= 0 || errno == ERANGE) {
-					fprintf(stderr, "Error: Invalid file size limit %s: %s (%d)\n",
-						optarg, strerror(errno), errno);
+				cfg.file_size_limit = parse_size(optarg);
+				if (cfg.file_size_limit <= 0) {
+					fprintf(stderr, "Error: Invalid file size limit %s\n",
+						optarg);
 					exit(EXIT_FAILURE);
 				}
 				printf("file_size_limit[%ld]: %s, %ld\n",
 					strlen(optarg), optarg, cfg.file_size_limit);
 			}
 
+			break;
+		case OPT_LIMIT_MODE:
+			if (strcmp(optarg, "stop") == 0) {
+				cfg.limit_mode = CAPTURE_LIMIT_STOP;
+			} else if (strcmp(optarg, "rotate") == 0) {
+				cfg.limit_mode = CAPTURE_LIMIT_ROTATE;
+			} else if (strcmp(optarg, "head-tail") == 0) {
+				cfg.limit_mode = CAPTURE_LIMIT_HEAD_TAIL;
+			} else {
+				fprintf(stderr, "Error: Invalid limit mode %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_ROTATE_KEEP:
+			cfg.rotate_keep = strtol(optarg, &end, 0);
+			if (cfg.rotate_keep < 0 || *end != '\0') {
+				fprintf(stderr, "Error: Invalid rotate count %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_KEEP_HEAD:
+			cfg.head_size = parse_size(optarg);
+			if (cfg.head_size <= 0) {
+				fprintf(stderr, "Error: Invalid size %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_KEEP_TAIL:
+			cfg.tail_size = parse_size(optarg);
+			if (cfg.tail_size <= 0) {
+				fprintf(stderr, "Error: Invalid size %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_MIN_FREE:
+			cfg.min_free = parse_size(optarg);
+			if (cfg.min_free < 0) {
+				fprintf(stderr, "Error: Invalid size %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_RECORD:
+			cfg.record = optarg;
+			break;
+		case OPT_RECORD_FORMAT:
+			if (strcmp(optarg, "json") == 0) {
+				cfg.record_format = RECORD_JSON;
+			} else if (strcmp(optarg, "bin") == 0) {
+				cfg.record_format = RECORD_BINARY;
+			} else {
+				fprintf(stderr, "Error: Invalid record format %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_FRAME:
+			if (strcmp(optarg, "cobs") == 0) {
+				cfg.frame_type = FRAME_COBS;
+			} else if (strcmp(optarg, "slip") == 0) {
+				cfg.frame_type = FRAME_SLIP;
+			} else if (strcmp(optarg, "hdlc") == 0) {
+				cfg.frame_type = FRAME_HDLC;
+			} else {
+				fprintf(stderr, "Error: Invalid frame type %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_FRAME_CRC:
+			if (strcmp(optarg, "none") == 0) {
+				cfg.frame_crc = FRAME_CRC_NONE;
+			} else if (strcmp(optarg, "crc16") == 0) {
+				cfg.frame_crc = FRAME_CRC16;
+			} else if (strcmp(optarg, "crc32") == 0) {
+				cfg.frame_crc = FRAME_CRC32;
+			} else {
+				fprintf(stderr, "Error: Invalid frame CRC %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_FRAME_OUT:
+			cfg.frame_out = optarg;
+			break;
+		case OPT_HEX:
+			cfg.hex = 1;
+			break;
+		case OPT_HEX_TX:
+			cfg.hex = 1;
+			cfg.hex_tx = 1;
+			break;
+		case OPT_DEDUP:
+			cfg.dedup = 1;
+			if (optarg) {
+				cfg.dedup_window = strtol(optarg, &end, 0);
+				if (cfg.dedup_window <= 0 || *end != '\0') {
+					fprintf(stderr, "Error: Invalid dedup window %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+			}
+			break;
+		case OPT_DEDUP_FILE:
+			cfg.dedup = 1;
+			cfg.dedup_file = 1;
+			break;
+		case OPT_CONSOLE_FILTER:
+		case OPT_FILE_FILTER:
+		case OPT_RECORD_FILTER:
+			if (opt == OPT_CONSOLE_FILTER)
+				sink_filter = &console_filter;
+			else if (opt == OPT_FILE_FILTER)
+				sink_filter = &file_filter;
+			else
+				sink_filter = &record_filter;
+			if (filter_add(&filters, sink_filter, optarg))
+				exit(EXIT_FAILURE);
+			break;
+		case OPT_TRACE:
+			cfg.trace = optarg;
+			break;
+		case OPT_SHM:
+			cfg.shm = optarg ? optarg : "";
+			break;
+		case OPT_SHM_SIZE:
+			cfg.shm_size = parse_size(optarg);
+			if (cfg.shm_size <= 0) {
+				fprintf(stderr, "Error: Invalid size %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_RT:
+			cfg.rt = 1;
+			if (optarg) {
+				cfg.rt_cpu = strtol(optarg, &end, 0);
+				if (cfg.rt_cpu < 0 || *end != '\0') {
+					fprintf(stderr, "Error: Invalid CPU %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+			}
+			break;
+		case OPT_RT_PRIO:
+			cfg.rt = 1;
+			cfg.rt_prio = strtol(optarg, &end, 0);
+			if (cfg.rt_prio < 1 || cfg.rt_prio > 99 || *end != '\0') {
+				fprintf(stderr, "Error: Invalid priority %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case OPT_RT_LOCK:
+			cfg.rt = 1;
+			cfg.rt_lock = 1;
+			break;
+		case OPT_RATE_LIMIT:
+			cfg.rate_limit = strtol(optarg, &end, 0);
+			if (cfg.rate_limit <= 0 || *end != '\0') {
+				fprintf(stderr, "Error: Invalid rate limit %s\n", optarg);
+				exit(EXIT_FAILURE);
+			}
 			break;
 		case 'v':
 			printf("Atty Version %s\n", ATTY_VERSION);
@@ -258,6 +1145,51 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (cfg.help) {
+		usage(argv[0]);
+		exit(EXIT_SUCCESS);
+	}
+
+	if (cfg.limit_mode == CAPTURE_LIMIT_HEAD_TAIL) {
+		long limit = cfg.file_size_limit ? cfg.file_size_limit : DEFAULT_FILE_SIZE_LIMIT;
+
+		if (cfg.head_size == 0)
+			cfg.head_size = cfg.tail_size ? limit - cfg.tail_size : limit / 2;
+		if (cfg.tail_size == 0)
+			cfg.tail_size = limit - cfg.head_size;
+		if (cfg.head_size <= 0 || cfg.tail_size <= 0) {
+			fprintf(stderr, "Error: Invalid head/tail sizes %ld/%ld\n",
+				cfg.head_size, cfg.tail_size);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (cfg.hex && (cfg.dedup || cfg.rate_limit || filter_active(&console_filter))) {
+		fprintf(stderr, "Error: --dedup, --rate-limit and --console-filter work on text, not with --hex\n");
+		exit(EXIT_FAILURE);
+	}
+
+	cfg.line_stage = cfg.dedup || cfg.rate_limit || filters.patterns;
+
+	// All the patterns are compiled into one matcher
+	if (filter_compile(&filters))
+		exit(EXIT_FAILURE);
+	line_console = !cfg.hex;
+	line_file = line_record = true;
+
+	if (cfg.trace && trace_init(cfg.trace))
+		exit(EXIT_FAILURE);
+
+	if (cfg.record && is_stdout_target(cfg.record) &&
+	    cfg.frame_out && is_stdout_target(cfg.frame_out)) {
+		fprintf(stderr, "Error: --record and --frame-out cannot both write to stdout\n");
+		exit(EXIT_FAILURE);
+	}
+	if (cfg.record && is_stdout_target(cfg.record))
+		cfg.record = stdout_to_records(record_target, sizeof(record_target));
+	if (cfg.frame_out && is_stdout_target(cfg.frame_out))
+		cfg.frame_out = stdout_to_records(frame_target, sizeof(frame_target));
+
 	#if (CONFIG_GETOPT_DEBUG)
 	exit(EXIT_SUCCESS);
 	#endif
@@ -282,75 +1214,127 @@ int main(int argc, char *argv[])
 	printf("Serial port %s opened successfully at %ld baud\n",
 		cfg.dev_name, cfg.baud_rate);
 
-	if (cfg.output_file) {
-		ret = create_parent_dirs(file_name);
-		if (ret) {
-			fprintf(stderr, "Error: Failed to create the path '%s': %s (%d)\n",
-				dirname(file_name), strerror(errno), errno);
+	fds[FD_SERIAL].fd = fd;
+	fds[FD_SERIAL].events = POLLIN;
+	fds[FD_STDIN].fd = STDIN_FILENO;
+	fds[FD_STDIN].events = POLLIN;
+	fds[FD_WATCHDOG].fd = -1;
+	fds[FD_WATCHDOG].events = POLLIN;
+	fds[FD_LOG_SETUP].fd = -1;
+	fds[FD_LOG_SETUP].events = POLLIN;
+	fds[FD_RT].fd = -1;
+	fds[FD_RT].events = POLLIN;
+	serial_fd = fd;
+
+	// The reader thread takes the port over, the loop polls its queue instead
+	if (cfg.rt) {
+		ret = rt_start(&rt, fd, cfg.rt_cpu, cfg.rt_prio, cfg.rt_lock,
+			       cfg.baud_rate);
+		if (ret < 0)
 			goto exit;
-		}
+		fds[FD_RT].fd = ret;
+		fds[FD_SERIAL].fd = -1;
 	}
 
+	/*
+	 * Files, sockets and the shared memory ring are opened on the log setup
+	 * thread. Meanwhile the log bytes go to the capture backlog, records
+	 * and frames to their buffers, and nothing is published.
+	 */
 	if (cfg.save) {
-		struct stat statbuf;
-		if (stat(default_log_dir, &statbuf) == 0) {
-			if (S_ISDIR(statbuf.st_mode) == 0) {
-				printf("%s: A path with the same name exists, but it is not a directory\n",
-					default_log_dir);
-				goto exit;
-			}
-		} else {
-			if (mkdir(default_log_dir, 0755) == 0) {
-				printf("create the folder '%s'\n", default_log_dir);
-			} else {
-				fprintf(stderr, "Error: Failed to create the folder '%s': %s (%d)\n",
-					default_log_dir, strerror(errno), errno);
-				goto exit;
-			}
-		}
+		cap.mode = cfg.limit_mode;
+		cap.limit = cfg.file_size_limit;
+		cap.rotate_keep = cfg.rotate_keep;
+		cap.head_size = cfg.head_size;
+		cap.tail_size = cfg.tail_size;
+		cap.min_free = cfg.min_free;
+		ret = capture_backlog_init(&cap, CAPTURE_BACKLOG_SIZE);
+		if (ret)
+			goto exit;
 	}
 
-	if (cfg.output_file || cfg.save) {
-		printf("Save log to the file '%s'\n", file_name);
-		fp = fopen(file_name, "w");
-		if (fp == NULL) {
-			fprintf(stderr, "Error: Failed to open the file '%s': %s (%d)\n",
-				file_name, strerror(errno), errno);
+	if (cfg.record) {
+		ret = record_init(&rec, cfg.record_format, cfg.dev_name);
+		if (ret)
 			goto exit;
-		}
 	}
 
-	// Attempt to retrieve the original user's UID and GID from environment variables
-	char *sudo_uid_str = getenv("SUDO_UID");
-	char *sudo_gid_str = getenv("SUDO_GID");
+	if (cfg.shm) {
+		if (cfg.shm[0] == '\0')
+			snprintf(setup.shm_name, sizeof(setup.shm_name), "atty-%s",
+				 basename(cfg.dev_name));
+		else
+			snprintf(setup.shm_name, sizeof(setup.shm_name), "%s", cfg.shm);
+	}
 
-	if ((sudo_uid_str != NULL) && (sudo_gid_str != NULL)) {
-		// Convert string values to uid_t and gid_t types
-		uid_t uid = (uid_t)atoi(sudo_uid_str);
-		gid_t gid = (gid_t)atoi(sudo_gid_str);
+	hexdump_init(&hex_rx, stdout, HEXDUMP_RX);
+	hexdump_init(&hex_tx, stdout, HEXDUMP_TX);
 
-		if (chown(file_name, uid, gid) == -1) {
-			fprintf(stderr, "Error: Failed to change file ownership: %s (%d)\n",
-				strerror(errno), errno);
+	console_out.write = console_write;
+	console_out.ctx = NULL;
+	console_out.new_line = true;
+	file_out.write = file_write;
+	file_out.ctx = &cap;
+	file_out.new_line = true;
+	line_init(&out_line);
+	storm_init(&storm, cfg.dedup, cfg.dedup_window, cfg.rate_limit);
+
+	if (cfg.frame_type != FRAME_NONE) {
+		if (cfg.frame_out) {
+			ret = frame_sink_init(&frame_sink, cfg.frame_out, cfg.dev_name);
+			if (ret)
+				goto exit;
+			frame_decoder_init(&frame_dec, cfg.frame_type, cfg.frame_crc,
+					   frame_sink_write, &frame_sink);
 		} else {
-			printf("Info: Successfully changed file ownership back to UID: %d, GID: %d\n",
-				uid, gid);
+			frame_decoder_init(&frame_dec, cfg.frame_type, cfg.frame_crc,
+					   NULL, NULL);
 		}
-	} else {
-        	printf("Info: Sudo environment not detected, file will retain current executor's ownership.\n");
-    	}
+	}
 
-	fds[0].fd = fd;
-	fds[0].events = POLLIN;
-	fds[1].fd = STDIN_FILENO;
-	fds[1].events = POLLIN;
+	if (cfg.save || cfg.record || cfg.shm ||
+	    (cfg.frame_type != FRAME_NONE && cfg.frame_out)) {
+		setup.cfg = &cfg;
+		setup.cap = &cap;
+		setup.file_name = file_name;
+		ret = log_setup_start(&setup);
+		if (ret < 0)
+			goto exit;
+		fds[FD_LOG_SETUP].fd = ret;
+	}
 
-	bool is_new_line = true;
 
 	clear_screen();
 
 	while (1) {
-		ret = poll(fds, NFDS, POLL_TIMEOUT_MS);
+		int timeout = POLL_TIMEOUT_MS;
+		u64 t;
+
+		if (trace_dump_requested)
+			trace_dump();
+
+		if (cfg.line_stage) {
+			if (out_line.len)
+				timeout = LINE_IDLE_MS;
+			else if (storm_pending(&storm))
+				timeout = STORM_TICK_MS;
+		}
+		if (cfg.frame_type != FRAME_NONE && frame_pending(&frame_dec))
+			timeout = LINE_IDLE_MS;
+
+		t = trace_begin();
+		ret = poll(fds, NFDS, timeout);
+		trace_end(TRACE_POLL, t, 0);
+		if (ret == 0) {
+			ret = handle_frame_idle(&cfg, &rx);
+			if (ret != CAPTURE_LIMIT_REACHED)
+				ret = output_idle(&cfg, false);
+			if (ret == CAPTURE_LIMIT_REACHED) {
+				printf("\nReached file size limit\n");
+				break;
+			}
+			continue;
+		}
 		if (ret < 0) {
 			if (errno == EINTR) {
 				#if (CONFIG_MAIN_DEBUG)
@@ -363,58 +1347,21 @@ int main(int argc, char *argv[])
 			break;
 		}
 
-		if (fds[0].revents & POLLIN) {
-			bytes_read = read(fd, data_in, sizeof(data_in)-1);
+		if (fds[FD_SERIAL].revents & POLLIN) {
+			t = trace_begin();
+			bytes_read = read(fd, data_in, sizeof(data_in));
+			trace_end(TRACE_READ, t, bytes_read > 0 ? bytes_read : 0);
 			if (bytes_read > 0) {
-				#if (CONFIG_MAIN_DEBUG)
-				printf("bytes_read: %ld\n", bytes_read);
-				#else
-				data_in[bytes_read] = '\0';
-
-				if (cfg.time) {
-					for (ssize_t i = 0; i < bytes_read; i++) {
-						// If it is the start of a new line, print the timestamp
-						if (is_new_line) {
-							struct timespec ts;
-							struct tm *t;
-							char time_str[64];
-
-							// Get current time with nanosecond precision
-							clock_gettime(CLOCK_REALTIME, &ts);
-
-							// Convert seconds to local time format
-							t = localtime(&ts.tv_sec);
-
-							// Format the time up to seconds: [YYYY-MM-DD HH:MM:SS
-							strftime(time_str, sizeof(time_str), "[%Y-%m-%d %H:%M:%S", t);
-
-							// Calculate milliseconds from nanoseconds (1 ms = 1,000,000 ns)
-							int ms = ts.tv_nsec / 1000000;
+				struct timespec mono, wall;
 
-							// Append milliseconds and the closing bracket
-							if (cfg.save && fp)
-								fprintf(fp, "%s.%03d] ", time_str, ms);
+				clock_gettime(CLOCK_MONOTONIC, &mono);
+				clock_gettime(CLOCK_REALTIME, &wall);
 
-							printf("%s.%03d] ", time_str, ms);
-							is_new_line = false;
-						}
-						// Output the current character one by one
-						if (cfg.save && fp)
-							fputc(data_in[i], fp);
-
-						putchar(data_in[i]);
-
-						// Check if the current character is a newline character
-						if (data_in[i] == '\n')
-							is_new_line = true;
-					}
-				} else {
-					if (cfg.save && fp)
-						fprintf(fp, "%s", data_in);
-					printf("%s", data_in);
+				ret = handle_data_in(&cfg, &rx, data_in, bytes_read, &mono, &wall);
+				if (ret == CAPTURE_LIMIT_REACHED) {
+					printf("\nReached file size limit\n");
+					break;
 				}
-				#endif
-				fflush(stdout);
 			} else if (bytes_read < 0) {
 				#if (CONFIG_NON_BLOCK_MODE)
 				if (errno == EAGAIN) {
@@ -432,18 +1379,61 @@ int main(int argc, char *argv[])
 			}
 		}
 
-		if (fds[0].revents & POLLHUP) {
+		if (fds[FD_RT].revents & POLLIN) {
+			struct rt_chunk c;
+			char *data;
+
+			rt_ack(&rt);
+			ret = 0;
+			while (rt_pop(&rt, &c, &data)) {
+				ret = handle_data_in(&cfg, &rx, data, c.len, &c.mono, &c.wall);
+				rt_release(&rt, &c);
+				if (ret == CAPTURE_LIMIT_REACHED)
+					break;
+			}
+			if (ret == CAPTURE_LIMIT_REACHED) {
+				printf("\nReached file size limit\n");
+				break;
+			}
+			if (rt_ended(&rt)) {
+				if (rt.error && rt.error != EIO)
+					fprintf(stderr, "Error: Failed to read from serial port %s: %s (%d)\n",
+						DEFAULT_SERIAL_PORT, strerror(rt.error), rt.error);
+				else
+					printf("Serial port %s disconnected\n", DEFAULT_SERIAL_PORT);
+				break;
+			}
+		}
+
+		if (fds[FD_SERIAL].revents & POLLHUP) {
 			printf("Serial port %s disconnected\n", DEFAULT_SERIAL_PORT);
 			break;
 		}
 
-		if (fds[0].revents & POLLERR) {
+		if (fds[FD_SERIAL].revents & POLLERR) {
 			fprintf(stderr, "Error: Error on serial port %s: %s (%d)\n",
 				DEFAULT_SERIAL_PORT, strerror(errno), errno);
 			break;
 		}
 
-		if (fds[1].revents & POLLIN) {
+		if (fds[FD_LOG_SETUP].revents & POLLIN) {
+			fds[FD_LOG_SETUP].fd = -1;
+			ret = log_setup_finish(&setup);
+			if (ret == CAPTURE_LIMIT_REACHED) {
+				printf("\nReached file size limit\n");
+				break;
+			} else if (ret) {
+				break;
+			}
+			if (cfg.save && cfg.min_free > 0)
+				fds[FD_WATCHDOG].fd = capture_watchdog_init(&cap, WATCHDOG_INTERVAL_S);
+		}
+
+		if (fds[FD_WATCHDOG].revents & POLLIN)
+			capture_watchdog_check(&cap);
+
+		if (fds[FD_STDIN].revents & POLLIN) {
+			t = trace_begin();
 			char *s = fgets(data_out, sizeof(data_out), stdin);
 			if (s == NULL) {
 				if (feof(stdin))
@@ -455,13 +1445,9 @@ int main(int argc, char *argv[])
 			}
 
 			#if (CONFIG_MAIN_DEBUG)
-			for (int i = 0; i < strlen(data_out); i++) {
-				printf("%02x ", data_out[i]);
-				if ((i+1) % 8 == 0)
-					printf("\n");
-				else if ((i+1) == strlen(data_out))
-					printf("\n");
-			}
+			struct hexdump hd;
+			hexdump_init(&hd, stdout, HEXDUMP_TX);
+			hexdump_write(&hd, data_out, strlen(data_out));
 			printf("strlen : %ld\n", strlen(data_out));
 			printf("strcspn: %ld\n", strcspn(data_out, "\n"));
 			#endif
@@ -488,23 +1474,80 @@ int main(int argc, char *argv[])
 					DEFAULT_SERIAL_PORT, strerror(errno), errno);
 				break;
 			}
-			if (cfg.file_size_limit > 0) {
-				total_bytes_written += bytes_written;
-				if (total_bytes_written >= cfg.file_size_limit) {
-					printf("Reached file size limit\n");
-					break;
-				}
+
+			if (cfg.hex_tx) {
+				hexdump_write(&hex_tx, data_out, bytes_written);
+				fflush(stdout);
 			}
+			trace_end(TRACE_STDIN, t, bytes_written);
 		}
 	}
 
 exit:
-	if (fp) {
+	// The session may end before the log setup thread is done
+	log_setup_finish(&setup);
+
+	// What the reader queued before it stopped was received all the same
+	if (rt.arena) {
+		struct rt_chunk c;
+		char *data;
+
+		rt_stop(&rt);
+		while (rt_pop(&rt, &c, &data)) {
+			handle_data_in(&cfg, &rx, data, c.len, &c.mono, &c.wall);
+			rt_release(&rt, &c);
+		}
+		rt_report(&rt);
+		rt_close(&rt);
+	}
+
+	handle_frame_idle(&cfg, &rx);
+	if (cfg.line_stage) {
+		output_idle(&cfg, true);
+		if (storm.collapsed || storm.limited)
+			printf("\nStorm: %llu repeated lines collapsed, %llu lines over the rate limit\n",
+				storm.collapsed, storm.limited);
+	}
+	filter_free(&filters);
+	trace_close();
+	shmring_destroy(&shm_ring);
+	capture_backlog_free(&cap);
+
+	if (rx.bytes) {
+		printf("\nInfo: First byte received %.3f ms after start\n",
+			elapsed_ms(&start_ts, &rx.first_ts));
+	}
+
+	if (cfg.frame_type != FRAME_NONE) {
+		printf("\nFrames: %llu decoded, %llu CRC errors, %llu overflows, %llu aborted\n",
+			frame_dec.frames, frame_dec.crc_errors, frame_dec.overflows,
+			frame_dec.aborts);
+		if (cfg.frame_out) {
+			frame_sink_close(&frame_sink);
+			printf("Frames: %llu written to '%s', %llu dropped\n",
+				frame_sink.sent, cfg.frame_out, frame_sink.dropped);
+		}
+	}
+
+	if (rec.buf) {
+		bool opened = rec.fd >= 0;
+
+		record_close(&rec);
+		if (opened)
+			printf("\nWrote %llu records to '%s'\n", rec.records, cfg.record);
+		if (opened && rec.dropped)
+			printf("Dropped %llu records before '%s' was open\n",
+				rec.dropped, cfg.record);
+	}
+
+	if (cap.fp) {
 		printf("\nSaved log to the file '%s'\n", file_name);
-		ret = fclose(fp);
-		if (ret < 0)
-			fprintf(stderr, "Error: Failed to close the file '%s': %s (%d)\n",
-				file_name, strerror(errno), errno);
+		capture_close(&cap);
+		if (cap.rotations)
+			printf("Rotated %d times\n", cap.rotations);
+		if (cap.dropped_bytes)
+			printf("Dropped %llu bytes while the disk was low on space\n",
+				cap.dropped_bytes);
 	}
 
 	ret = close(fd);
@@ -0,0 +1,306 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "global.h"
+#include "merge.h"
+
+/*
+ * atty-merge: merge the -t logs of several ports into one timeline. Every
+ * input is memory mapped and read once from start to end; the pages already
+ * merged are dropped, so the memory used does not grow with the file sizes.
+ */
+
+void usage(const char *prog)
+{
+	printf("Usage: %s [-o <file>] [<name>=]<log> ...\n"
+		"Merge logs written with atty -t into one timeline, each line prefixed\n"
+		"by its source. The source is <name>, or the log file name without .txt.\n"
+		"  -o <file>          Write to <file> instead of stdout\n"
+		"  -h                 Show this help\n",
+		prog);
+}
+
+static inline bool is_digit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+/*
+ * Parse "[YYYY-MM-DD HH:MM:SS.mmm] " into YYYYMMDDHHMMSSmmm, which orders
+ * like the time it stands for.
+ */
+bool merge_stamp(const char *s, size_t len, u64 *key)
+{
+	static const u8 digits[] = { 1, 2, 3, 4, 6, 7, 9, 10, 12, 13, 15, 16,
+				     18, 19, 21, 22, 23 };
+	u64 k = 0;
+
+	if (len < MERGE_STAMP_LEN || s[0] != '[' || s[24] != ']' || s[20] != '.')
+		return false;
+
+	for (size_t i = 0; i < sizeof(digits); i++) {
+		char c = s[digits[i]];
+
+		if (!is_digit(c))
+			return false;
+		k = k * 10 + (c - '0');
+	}
+
+	*key = k;
+	return true;
+}
+
+// Drop the pages that were merged already
+static void merge_release(struct merge_src *src, bool all)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t upto = all ? src->size : src->pos & ~(page - 1);
+
+	if (upto < src->released + (all ? 1 : MERGE_RELEASE_SIZE))
+		return;
+
+	madvise((char *)src->base + src->released, upto - src->released, MADV_DONTNEED);
+	src->released = upto;
+}
+
+/*
+ * Move to the next entry: a line and the lines without a timestamp after
+ * it. Returns false at the end of the file.
+ */
+bool merge_next(struct merge_src *src)
+{
+	const char *s = src->base;
+	const char *nl;
+	size_t pos;
+
+	src->pos = src->end;
+	if (src->pos >= src->size)
+		return false;
+
+	// Leading lines without a timestamp keep the key of 0
+	merge_stamp(s + src->pos, src->size - src->pos, &src->key);
+
+	pos = src->pos;
+	do {
+		nl = memchr(s + pos, '\n', src->size - pos);
+		pos = nl ? (size_t)(nl - s) + 1 : src->size;
+	} while (pos < src->size && !merge_stamp(s + pos, src->size - pos, &(u64){ 0 }));
+	src->end = pos;
+
+	merge_release(src, false);
+
+	return true;
+}
+
+// Write the current entry, every line prefixed by the source
+void merge_emit(struct merge_src *src, FILE *out)
+{
+	const char *s = src->base + src->pos;
+	const char *end = src->base + src->end;
+	const char *nl;
+	size_t n;
+
+	while (s < end) {
+		nl = memchr(s, '\n', end - s);
+		n = nl ? (size_t)(nl - s) + 1 : (size_t)(end - s);
+
+		fwrite(src->prefix, 1, src->prefix_len, out);
+		fwrite(s, 1, n, out);
+		if (nl == NULL)
+			fputc('\n', out);
+		s += n;
+	}
+}
+
+static inline bool merge_less(const struct merge_src *a, const struct merge_src *b)
+{
+	return a->key < b->key || (a->key == b->key && a->index < b->index);
+}
+
+void heap_sift_down(struct merge_heap *heap, int i)
+{
+	struct merge_src **h = heap->src;
+	struct merge_src *src = h[i];
+	int child;
+
+	while ((child = 2 * i + 1) < heap->len) {
+		if (child + 1 < heap->len && merge_less(h[child + 1], h[child]))
+			child++;
+		if (!merge_less(h[child], src))
+			break;
+		h[i] = h[child];
+		i = child;
+	}
+	h[i] = src;
+}
+
+// Map the log and take its name from "<name>=" or the file name
+int merge_open(struct merge_src *src, const char *arg, int index)
+{
+	const char *path = arg;
+	const char *eq = strchr(arg, '=');
+	char *name = src->name;
+	struct stat st;
+	char *dot;
+	int fd;
+
+	memset(src, 0, sizeof(*src));
+	src->index = index;
+
+	if (eq && memchr(arg, '/', eq - arg) == NULL) {
+		snprintf(name, MERGE_NAME_MAX, "%.*s", (int)(eq - arg), arg);
+		path = eq + 1;
+	} else {
+		char tmp[PATH_MAX];
+
+		snprintf(tmp, sizeof(tmp), "%s", arg);
+		snprintf(name, MERGE_NAME_MAX, "%s", basename(tmp));
+		dot = strrchr(name, '.');
+		if (dot && strcmp(dot, ".txt") == 0)
+			*dot = '\0';
+	}
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Error: Failed to open '%s': %s (%d)\n",
+			path, strerror(errno), errno);
+		return -errno;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		fprintf(stderr, "Error: Failed to stat '%s': %s (%d)\n",
+			path, strerror(errno), errno);
+		close(fd);
+		return -errno;
+	}
+
+	src->size = st.st_size;
+	if (src->size == 0) {
+		close(fd);
+		return 0;
+	}
+
+	src->base = mmap(NULL, src->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	// The mapping keeps the file, so hundreds of logs need no open descriptors
+	close(fd);
+	if (src->base == MAP_FAILED) {
+		fprintf(stderr, "Error: Failed to map '%s': %s (%d)\n",
+			path, strerror(errno), errno);
+		src->base = NULL;
+		return -errno;
+	}
+	madvise((char *)src->base, src->size, MADV_SEQUENTIAL);
+
+	return 0;
+}
+
+void merge_close(struct merge_src *src)
+{
+	if (src->base) {
+		merge_release(src, true);
+		munmap((char *)src->base, src->size);
+		src->base = NULL;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct merge_src *srcs;
+	struct merge_heap heap;
+	const char *out_name = NULL;
+	FILE *out = stdout;
+	int width = 0;
+	int opt, n, ret = 0;
+
+	while ((opt = getopt(argc, argv, "ho:")) != -1) {
+		switch (opt) {
+		case 'o':
+			out_name = optarg;
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit(EXIT_SUCCESS);
+		default:
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	n = argc - optind;
+	if (n == 0) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	srcs = calloc(n, sizeof(*srcs));
+	heap.src = calloc(n, sizeof(*heap.src));
+	if (srcs == NULL || heap.src == NULL) {
+		fprintf(stderr, "Error: Failed to allocate %d sources: %s (%d)\n",
+			n, strerror(errno), errno);
+		exit(EXIT_FAILURE);
+	}
+
+	for (int i = 0; i < n; i++) {
+		if (merge_open(&srcs[i], argv[optind + i], i))
+			exit(EXIT_FAILURE);
+		if ((int)strlen(srcs[i].name) > width)
+			width = strlen(srcs[i].name);
+	}
+
+	if (out_name) {
+		out = fopen(out_name, "w");
+		if (out == NULL) {
+			fprintf(stderr, "Error: Failed to open '%s': %s (%d)\n",
+				out_name, strerror(errno), errno);
+			exit(EXIT_FAILURE);
+		}
+	}
+	setvbuf(out, NULL, _IOFBF, MERGE_OUT_BUF_SIZE);
+
+	// Pad the names so the logs line up
+	heap.len = 0;
+	for (int i = 0; i < n; i++) {
+		struct merge_src *src = &srcs[i];
+
+		src->prefix_len = snprintf(src->prefix, sizeof(src->prefix), "%-*s | ",
+					   width, src->name);
+		if (merge_next(src))
+			heap.src[heap.len++] = src;
+		else
+			merge_close(src);
+	}
+
+	for (int i = heap.len / 2 - 1; i >= 0; i--)
+		heap_sift_down(&heap, i);
+
+	while (heap.len) {
+		struct merge_src *src = heap.src[0];
+
+		merge_emit(src, out);
+		if (!merge_next(src)) {
+			merge_close(src);
+			heap.src[0] = heap.src[--heap.len];
+		}
+		heap_sift_down(&heap, 0);
+	}
+
+	if (fflush(out) || (out != stdout && fclose(out))) {
+		fprintf(stderr, "Error: Failed to write '%s': %s (%d)\n",
+			out_name ? out_name : "stdout", strerror(errno), errno);
+		ret = -errno;
+	}
+
+	free(heap.src);
+	free(srcs);
+
+	return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
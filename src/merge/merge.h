@@ -0,0 +1,45 @@
+#ifndef MERGE_H
+#define MERGE_H
+
+#include <stddef.h>
+#include "types.h"
+
+#define MERGE_NAME_MAX			(64)
+#define MERGE_OUT_BUF_SIZE		(1 * MB)
+
+// Pages behind the read position are dropped in steps of this size
+#define MERGE_RELEASE_SIZE		(4 * MB)
+
+// "[YYYY-MM-DD HH:MM:SS.mmm] " as written by atty -t
+#define MERGE_STAMP_LEN			(26)
+
+/*
+ * One input file, mapped whole. An entry is a timestamped line plus the
+ * lines without a timestamp that follow it, so that continuation lines stay
+ * with their line in the merged output.
+ */
+struct merge_src
+{
+	int index;
+	char name[MERGE_NAME_MAX];
+	char prefix[MERGE_NAME_MAX + 4];	// name padded to the longest one, " | "
+	int prefix_len;
+	const char *base;
+	size_t size;
+	size_t pos;			// start of the current entry
+	size_t end;			// end of the current entry
+	size_t released;		// pages before this offset were dropped
+	u64 key;			// timestamp of the current entry
+};
+
+/*
+ * Min-heap of the sources by (key, index). Ties go to the source given
+ * first, so the merge is deterministic.
+ */
+struct merge_heap
+{
+	struct merge_src **src;
+	int len;
+};
+
+#endif
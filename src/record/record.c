@@ -0,0 +1,341 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "record.h"
+
+// Worst case of one JSON record: every byte escaped as \u00XX
+#define RECORD_JSON_MAX(len)		((len) * 6 + RECORD_PORT_MAX * 6 + 256)
+#define RECORD_BINARY_MAX(len)		(sizeof(struct record_hdr) + (len))
+
+static const char hex_digits[] = "0123456789abcdef";
+static const char b64_digits[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static char *put_str(char *p, const char *s, size_t n)
+{
+	memcpy(p, s, n);
+	return p + n;
+}
+
+static char *put_u64(char *p, u64 v)
+{
+	char tmp[20];
+	int i = 0;
+
+	do {
+		tmp[i++] = '0' + v % 10;
+		v /= 10;
+	} while (v);
+
+	while (i)
+		*p++ = tmp[--i];
+
+	return p;
+}
+
+static char *put_json(char *p, const u8 *s, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		u8 c = s[i];
+
+		if (c >= 0x20 && c < 0x7f && c != '"' && c != '\\') {
+			*p++ = c;
+			continue;
+		}
+
+		*p++ = '\\';
+		switch (c) {
+		case '"':
+			*p++ = '"';
+			break;
+		case '\\':
+			*p++ = '\\';
+			break;
+		case '\t':
+			*p++ = 't';
+			break;
+		case '\r':
+			*p++ = 'r';
+			break;
+		case '\n':
+			*p++ = 'n';
+			break;
+		default:
+			*p++ = 'u';
+			*p++ = '0';
+			*p++ = '0';
+			*p++ = hex_digits[c >> 4];
+			*p++ = hex_digits[c & 0xf];
+			break;
+		}
+	}
+
+	return p;
+}
+
+static char *put_b64(char *p, const u8 *s, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i + 3 <= n; i += 3) {
+		u32 v = (s[i] << 16) | (s[i + 1] << 8) | s[i + 2];
+		*p++ = b64_digits[(v >> 18) & 0x3f];
+		*p++ = b64_digits[(v >> 12) & 0x3f];
+		*p++ = b64_digits[(v >> 6) & 0x3f];
+		*p++ = b64_digits[v & 0x3f];
+	}
+
+	if (i < n) {
+		u32 v = s[i] << 16;
+		if (i + 1 < n)
+			v |= s[i + 1] << 8;
+		*p++ = b64_digits[(v >> 18) & 0x3f];
+		*p++ = b64_digits[(v >> 12) & 0x3f];
+		*p++ = (i + 1 < n) ? b64_digits[(v >> 6) & 0x3f] : '=';
+		*p++ = '=';
+	}
+
+	return p;
+}
+
+static bool is_text(const u8 *s, size_t n)
+{
+	for (size_t i = 0; i < n; i++) {
+		if (s[i] == 0 || s[i] >= 0x80)
+			return false;
+	}
+	return true;
+}
+
+static u64 timespec_ns(const struct timespec *ts)
+{
+	return (u64)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+// Records are kept in the buffer until the target is open
+int record_flush(struct record *rec)
+{
+	const char *p = rec->buf;
+	size_t len = rec->len;
+	ssize_t n;
+
+	if (rec->fd < 0)
+		return 0;
+
+	while (len) {
+		n = write(rec->fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (rec->error == 0)
+				fprintf(stderr, "Error: Failed to write records: %s (%d)\n",
+					strerror(errno), errno);
+			rec->error = -errno;
+			break;
+		}
+		p += n;
+		len -= n;
+	}
+	rec->len = 0;
+
+	return rec->error;
+}
+
+/*
+ * Open a record target: a file, '-' for stdout or 'fd:<n>'. Returns the fd
+ * or a negative error; close_fd tells whether the fd belongs to the records.
+ */
+int record_target_open(const char *target, bool *close_fd)
+{
+	char *end;
+	int fd;
+
+	*close_fd = false;
+
+	if (strcmp(target, "-") == 0)
+		return STDOUT_FILENO;
+
+	if (strncmp(target, "fd:", 3) == 0) {
+		fd = strtol(target + 3, &end, 0);
+		if (*end != '\0' || fd < 0) {
+			fprintf(stderr, "Error: Invalid record target %s\n", target);
+			return -EINVAL;
+		}
+		return fd;
+	}
+
+	fd = open(target, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Error: Failed to open the file '%s': %s (%d)\n",
+			target, strerror(errno), errno);
+		return -errno;
+	}
+	*close_fd = true;
+
+	return fd;
+}
+
+/*
+ * Set up the buffer, without a target yet: records are written into the
+ * buffer until fd is set.
+ */
+int record_init(struct record *rec, int format, const char *port)
+{
+	size_t port_len = strlen(port);
+
+	if (port_len > RECORD_PORT_MAX)
+		port_len = RECORD_PORT_MAX;
+
+	rec->fd = -1;
+	rec->format = format;
+	rec->len = 0;
+	rec->records = 0;
+	rec->dropped = 0;
+	rec->error = 0;
+	rec->close_fd = false;
+	line_init(&rec->line);
+
+	rec->buf = malloc(RECORD_BUF_SIZE);
+	if (rec->buf == NULL) {
+		fprintf(stderr, "Error: Failed to allocate memory: %s (%d)\n",
+			strerror(errno), errno);
+		return -ENOMEM;
+	}
+
+	if (format == RECORD_BINARY) {
+		struct record_file_hdr hdr = {
+			.magic = RECORD_MAGIC,
+			.version = RECORD_VERSION,
+			.port_len = port_len,
+		};
+		memcpy(rec->port, port, port_len);
+		rec->port_len = port_len;
+		memcpy(rec->buf, &hdr, sizeof(hdr));
+		memcpy(rec->buf + sizeof(hdr), port, port_len);
+		rec->len = sizeof(hdr) + port_len;
+	} else {
+		// The port is constant, keep it JSON escaped
+		rec->port_len = put_json(rec->port, (const u8 *)port, port_len) - rec->port;
+	}
+
+	return 0;
+}
+
+int record_open(struct record *rec, const char *target, int format,
+		const char *port)
+{
+	int ret;
+
+	ret = record_init(rec, format, port);
+	if (ret)
+		return ret;
+
+	ret = record_target_open(target, &rec->close_fd);
+	if (ret < 0)
+		return ret;
+	rec->fd = ret;
+
+	return 0;
+}
+
+int record_write(struct record *rec, const void *data, size_t len, u16 flags,
+		 u64 offset, const struct timespec *mono,
+		 const struct timespec *wall)
+{
+	const u8 *s = data;
+	size_t need;
+	char *p;
+
+	need = rec->format == RECORD_BINARY ? RECORD_BINARY_MAX(len) : RECORD_JSON_MAX(len);
+	if (need > RECORD_BUF_SIZE)
+		return -EMSGSIZE;
+	if (rec->len + need > RECORD_BUF_SIZE)
+		record_flush(rec);
+	if (rec->len + need > RECORD_BUF_SIZE) {
+		rec->dropped++;
+		return -ENOBUFS;
+	}
+	p = rec->buf + rec->len;
+
+	if (rec->format == RECORD_BINARY) {
+		struct record_hdr hdr = {
+			.len = len,
+			.flags = flags,
+			.mono_ns = timespec_ns(mono),
+			.wall_ns = timespec_ns(wall),
+			.offset = offset,
+		};
+
+		p = put_str(p, (const char *)&hdr, sizeof(hdr));
+		p = put_str(p, (const char *)s, len);
+	} else {
+		p = put_str(p, "{\"mono_ns\":", 11);
+		p = put_u64(p, timespec_ns(mono));
+		p = put_str(p, ",\"wall_ns\":", 11);
+		p = put_u64(p, timespec_ns(wall));
+		p = put_str(p, ",\"port\":\"", 9);
+		p = put_str(p, rec->port, rec->port_len);
+		p = put_str(p, "\",\"offset\":", 11);
+		p = put_u64(p, offset);
+		if (flags & RECORD_FLAG_PARTIAL)
+			p = put_str(p, ",\"partial\":true", 15);
+		if (is_text(s, len)) {
+			p = put_str(p, ",\"text\":\"", 9);
+			p = put_json(p, s, len);
+		} else {
+			p = put_str(p, ",\"b64\":\"", 8);
+			p = put_b64(p, s, len);
+		}
+		p = put_str(p, "\"}\n", 3);
+	}
+
+	rec->len = p - rec->buf;
+	rec->records++;
+
+	return 0;
+}
+
+void record_line(struct line *line, void *ctx)
+{
+	struct record *rec = ctx;
+	size_t n = line->len;
+
+	// Records carry the line without its terminator
+	if (n && line->buf[n - 1] == '\n') {
+		n--;
+		if (n && line->buf[n - 1] == '\r')
+			n--;
+	}
+
+	record_write(rec, line->buf, n, line->partial ? RECORD_FLAG_PARTIAL : 0,
+		     line->offset, &line->mono, &line->wall);
+}
+
+void record_feed(struct record *rec, const char *data, size_t len, u64 offset,
+		 const struct timespec *mono, const struct timespec *wall)
+{
+	line_feed(&rec->line, data, len, offset, mono, wall, record_line, rec);
+}
+
+int record_close(struct record *rec)
+{
+	int ret;
+
+	line_flush(&rec->line, record_line, rec);
+	ret = record_flush(rec);
+
+	if (rec->close_fd && close(rec->fd) < 0) {
+		fprintf(stderr, "Error: Failed to close records: %s (%d)\n",
+			strerror(errno), errno);
+		ret = -errno;
+	}
+	rec->fd = -1;
+	free(rec->buf);
+	rec->buf = NULL;
+
+	return ret;
+}
@@ -0,0 +1,79 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stddef.h>
+#include <time.h>
+#include "types.h"
+#include "line.h"
+
+#define RECORD_BUF_SIZE			(256 * 1024)
+#define RECORD_PORT_MAX			(256)
+
+#define RECORD_MAGIC			"ATTYREC1"
+#define RECORD_VERSION			(1)
+
+#define RECORD_FLAG_PARTIAL		(1 << 0)
+
+enum record_format {
+	RECORD_JSON = 0,
+	RECORD_BINARY,
+};
+
+/*
+ * JSON Lines: one object per received line
+ *   {"mono_ns":N,"wall_ns":N,"port":"...","offset":N,"text":"..."}
+ * "text" becomes "b64" when the line holds NUL or non-ASCII bytes, and
+ * "partial":true is added when the line was not terminated by '\n'.
+ *
+ * Binary: the file starts with struct record_file_hdr followed by port_len
+ * bytes of port name, then one struct record_hdr plus payload per line. All
+ * fields are in host byte order.
+ */
+struct record_file_hdr
+{
+	char magic[8];
+	u16 version;
+	u16 port_len;
+	u32 reserved;
+};
+
+struct record_hdr
+{
+	u32 len;
+	u16 flags;
+	u16 reserved;
+	u64 mono_ns;
+	u64 wall_ns;
+	u64 offset;
+};
+
+struct record
+{
+	int fd;
+	bool close_fd;
+	int format;
+	char port[RECORD_PORT_MAX * 6];
+	size_t port_len;
+	char *buf;
+	size_t len;
+	struct line line;
+	u64 records;
+	u64 dropped;			// buffer full before the target was open
+	int error;
+};
+
+extern int record_init(struct record *rec, int format, const char *port);
+extern int record_target_open(const char *target, bool *close_fd);
+extern int record_open(struct record *rec, const char *target, int format,
+		       const char *port);
+extern void record_feed(struct record *rec, const char *data, size_t len,
+			u64 offset, const struct timespec *mono,
+			const struct timespec *wall);
+extern int record_write(struct record *rec, const void *data, size_t len,
+			u16 flags, u64 offset, const struct timespec *mono,
+			const struct timespec *wall);
+extern void record_line(struct line *line, void *ctx);
+extern int record_flush(struct record *rec);
+extern int record_close(struct record *rec);
+
+#endif
@@ -0,0 +1,349 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#if defined(LINUX)
+#include <linux/serial.h>
+#endif
+
+#include "rtcap.h"
+#include "trace.h"
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE		(23)
+#endif
+
+// Where the reader puts what it cannot queue, so the kernel buffer still drains
+static u8 drop_buf[RT_READ_MAX];
+
+static inline u64 rt_ns(const struct timespec *ts)
+{
+	return (u64)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+// The error counters of the UART driver, if it keeps them
+static bool rt_icount(int fd, int *count)
+{
+	#if defined(LINUX) && defined(TIOCGICOUNT)
+	struct serial_icounter_struct ic;
+
+	if (ioctl(fd, TIOCGICOUNT, &ic) < 0)
+		return false;
+
+	count[0] = ic.rx;
+	count[1] = ic.frame;
+	count[2] = ic.parity;
+	count[3] = ic.overrun;
+	count[4] = ic.buf_overrun;
+	return true;
+	#else
+	return false;
+	#endif
+}
+
+// One byte in the pipe is enough until the main loop has acknowledged it
+static void rt_notify(struct rt_reader *rt)
+{
+	if (__atomic_exchange_n(&rt->notified, 1, __ATOMIC_SEQ_CST))
+		return;
+
+	if (write(rt->pipe_fd[1], "", 1) < 0 && errno != EAGAIN)
+		fprintf(stderr, "Error: Failed to notify the main loop: %s (%d)\n",
+			strerror(errno), errno);
+}
+
+static void rt_setup_thread(struct rt_reader *rt)
+{
+	char stack[RT_STACK_PREFAULT];
+	int ret;
+
+	trace_thread("rt reader", TRACE_THREAD_EVENTS);
+
+	if (rt->cpu >= 0) {
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(rt->cpu, &set);
+		ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (ret)
+			fprintf(stderr, "Warning: Failed to pin the reader to CPU %d: %s (%d)\n",
+				rt->cpu, strerror(ret), ret);
+	}
+
+	if (rt->prio > 0) {
+		struct sched_param sp = { .sched_priority = rt->prio };
+
+		ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp);
+		if (ret)
+			fprintf(stderr, "Warning: Failed to set SCHED_FIFO priority %d: %s (%d)\n",
+				rt->prio, strerror(ret), ret);
+	}
+
+	// Fault the stack and the drop buffer in before the first read
+	memset(stack, 0, sizeof(stack));
+	__asm__ __volatile__("" : : "r"(stack) : "memory");
+	memset(drop_buf, 0, sizeof(drop_buf));
+}
+
+void *rt_thread(void *arg)
+{
+	struct rt_reader *rt = arg;
+	struct pollfd pfd = { .fd = rt->fd, .events = POLLIN };
+	struct timespec mono, wall;
+	struct rt_chunk *c;
+	u64 head = 0, tail, pos, room, space;
+	bool drop;
+	ssize_t n;
+	int ret;
+	u64 t;
+
+	rt_setup_thread(rt);
+
+	while (!__atomic_load_n(&rt->stop, __ATOMIC_ACQUIRE)) {
+		ret = poll(&pfd, 1, RT_POLL_MS);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			rt->error = errno;
+			break;
+		}
+		if (ret == 0)
+			continue;
+
+		// Hung up or failed with nothing left to read
+		if (!(pfd.revents & POLLIN)) {
+			rt->error = (pfd.revents & POLLERR) ? EIO : 0;
+			break;
+		}
+
+		tail = __atomic_load_n(&rt->arena_tail, __ATOMIC_ACQUIRE);
+		space = RT_ARENA_SIZE - (head - tail);
+		pos = head & (RT_ARENA_SIZE - 1);
+		room = RT_ARENA_SIZE - pos;
+
+		// Chunks never wrap, skip the end of the arena when it is short
+		if (room < RT_READ_MIN && space >= room + RT_READ_MIN) {
+			head += room;
+			space -= room;
+			pos = 0;
+			room = RT_ARENA_SIZE;
+		}
+		if (room > space)
+			room = space;
+		if (room > RT_READ_MAX)
+			room = RT_READ_MAX;
+
+		drop = room < RT_READ_MIN ||
+		       rt->queue_head - __atomic_load_n(&rt->queue_tail, __ATOMIC_ACQUIRE) == RT_QUEUE_LEN;
+
+		t = trace_begin();
+		if (drop)
+			n = read(rt->fd, drop_buf, sizeof(drop_buf));
+		else
+			n = read(rt->fd, rt->arena + pos, room);
+		trace_end(TRACE_READ, t, n > 0 ? n : 0);
+		clock_gettime(CLOCK_MONOTONIC, &mono);
+		clock_gettime(CLOCK_REALTIME, &wall);
+
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			rt->error = errno;
+			break;
+		}
+		if (n == 0)
+			break;
+
+		rt->reads++;
+		rt->bytes += n;
+		if (n > rt->max_read)
+			rt->max_read = n;
+
+		// The main loop fell this far behind: count the loss instead of hiding it
+		if (drop) {
+			rt->dropped += n;
+			continue;
+		}
+
+		c = &rt->queue[rt->queue_head & (RT_QUEUE_LEN - 1)];
+		c->pos = head;
+		c->len = n;
+		c->mono = mono;
+		c->wall = wall;
+		head += n;
+		__atomic_store_n(&rt->queue_head, rt->queue_head + 1, __ATOMIC_SEQ_CST);
+		rt_notify(rt);
+	}
+
+	__atomic_store_n(&rt->ended, 1, __ATOMIC_SEQ_CST);
+	rt_notify(rt);
+
+	return NULL;
+}
+
+/*
+ * Start the reader thread on the serial port fd. Returns the read end of
+ * the notification pipe for the main loop to poll.
+ */
+int rt_start(struct rt_reader *rt, int fd, int cpu, int prio, bool lock,
+	     long baud_rate)
+{
+	int ret;
+
+	memset(rt, 0, sizeof(*rt));
+	rt->fd = fd;
+	rt->cpu = cpu;
+	rt->prio = prio;
+	rt->lock = lock;
+	rt->baud_rate = baud_rate;
+
+	rt->arena = mmap(NULL, RT_ARENA_SIZE, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (rt->arena == MAP_FAILED) {
+		fprintf(stderr, "Error: Failed to allocate the receive arena: %s (%d)\n",
+			strerror(errno), errno);
+		rt->arena = NULL;
+		return -errno;
+	}
+
+	rt->icount_valid = rt_icount(fd, rt->icount_start);
+
+	if (pipe(rt->pipe_fd) < 0) {
+		fprintf(stderr, "Error: Failed to create a pipe: %s (%d)\n",
+			strerror(errno), errno);
+		ret = -errno;
+		goto err_arena;
+	}
+	fcntl(rt->pipe_fd[0], F_SETFL, O_NONBLOCK);
+	fcntl(rt->pipe_fd[1], F_SETFL, O_NONBLOCK);
+
+	ret = pthread_create(&rt->thread, NULL, rt_thread, rt);
+	if (ret) {
+		fprintf(stderr, "Error: Failed to create the reader thread: %s (%d)\n",
+			strerror(ret), ret);
+		close(rt->pipe_fd[0]);
+		close(rt->pipe_fd[1]);
+		ret = -ret;
+		goto err_arena;
+	}
+	rt->running = true;
+
+	/*
+	 * The reader is running, so the pages are faulted in behind it rather
+	 * than before the first read. Older kernels fault them on first use.
+	 */
+	madvise(rt->arena, RT_ARENA_SIZE, MADV_POPULATE_WRITE);
+	if (lock && mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+		fprintf(stderr, "Warning: Failed to lock the memory: %s (%d)\n",
+			strerror(errno), errno);
+
+	return rt->pipe_fd[0];
+
+err_arena:
+	munmap(rt->arena, RT_ARENA_SIZE);
+	rt->arena = NULL;
+	return ret;
+}
+
+// Take the notification; call before rt_pop() drains the queue
+void rt_ack(struct rt_reader *rt)
+{
+	char buf[64];
+
+	while (read(rt->pipe_fd[0], buf, sizeof(buf)) > 0)
+		;
+	__atomic_store_n(&rt->notified, 0, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Get the oldest chunk. Its data stays valid, and may be changed in place,
+ * until rt_release().
+ */
+bool rt_pop(struct rt_reader *rt, struct rt_chunk *c, char **data)
+{
+	struct timespec now;
+	u64 wait;
+
+	if (rt->queue_tail == __atomic_load_n(&rt->queue_head, __ATOMIC_SEQ_CST))
+		return false;
+
+	*c = rt->queue[rt->queue_tail & (RT_QUEUE_LEN - 1)];
+	*data = (char *)rt->arena + (c->pos & (RT_ARENA_SIZE - 1));
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	wait = rt_ns(&now) - rt_ns(&c->mono);
+	if (wait > rt->max_queue_ns)
+		rt->max_queue_ns = wait;
+
+	return true;
+}
+
+void rt_release(struct rt_reader *rt, const struct rt_chunk *c)
+{
+	__atomic_store_n(&rt->queue_tail, rt->queue_tail + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&rt->arena_tail, c->pos + c->len, __ATOMIC_RELEASE);
+}
+
+// The port is gone and every chunk read before was taken
+bool rt_ended(struct rt_reader *rt)
+{
+	return __atomic_load_n(&rt->ended, __ATOMIC_SEQ_CST) &&
+	       rt->queue_tail == __atomic_load_n(&rt->queue_head, __ATOMIC_SEQ_CST);
+}
+
+// Stop the reader. The chunks it queued stay for rt_pop() until rt_close()
+void rt_stop(struct rt_reader *rt)
+{
+	if (!rt->running)
+		return;
+
+	__atomic_store_n(&rt->stop, 1, __ATOMIC_RELEASE);
+	pthread_join(rt->thread, NULL);
+	rt->running = false;
+}
+
+void rt_close(struct rt_reader *rt)
+{
+	if (rt->arena == NULL)
+		return;
+
+	rt_stop(rt);
+	close(rt->pipe_fd[0]);
+	close(rt->pipe_fd[1]);
+	munmap(rt->arena, RT_ARENA_SIZE);
+	rt->arena = NULL;
+}
+
+/*
+ * The largest read shows how full the kernel buffer got: at the configured
+ * baud rate its oldest byte had waited at least that long, which is the
+ * read latency while data keeps coming.
+ */
+void rt_report(struct rt_reader *rt)
+{
+	int count[5];
+
+	printf("\nRT reader: %llu reads, %llu bytes, %llu bytes dropped\n",
+		rt->reads, rt->bytes, rt->dropped);
+	printf("RT reader: worst read %u bytes, %.3f ms of data at %ld baud\n",
+		rt->max_read, rt->max_read * 10 * 1000.0 / rt->baud_rate, rt->baud_rate);
+	printf("RT reader: worst wait for the main loop %.3f ms\n",
+		rt->max_queue_ns / 1e6);
+
+	if (rt->icount_valid && rt_icount(rt->fd, count)) {
+		printf("RT reader: driver counted %d overruns, %d buffer overruns, %d framing and %d parity errors\n",
+			count[3] - rt->icount_start[3], count[4] - rt->icount_start[4],
+			count[1] - rt->icount_start[1], count[2] - rt->icount_start[2]);
+	} else {
+		printf("RT reader: the driver keeps no overrun counters\n");
+	}
+}
@@ -0,0 +1,74 @@
+#ifndef RTCAP_H
+#define RTCAP_H
+
+#include <pthread.h>
+#include <time.h>
+#include "types.h"
+
+#define RT_ARENA_SIZE			(16 * MB)	// power of 2
+#define RT_QUEUE_LEN			(4096)		// power of 2
+#define RT_READ_MAX			(64 * KB)
+#define RT_READ_MIN			(4 * KB)	// wrap the arena below this
+#define RT_POLL_MS			(100)
+#define RT_STACK_PREFAULT		(64 * KB)
+
+// A chunk read by the reader thread, at pos in the arena
+struct rt_chunk
+{
+	u64 pos;
+	u32 len;
+	struct timespec mono;
+	struct timespec wall;
+};
+
+/*
+ * Real-time capture: a thread that does nothing but read the tty into a
+ * prefaulted arena and queue the chunks for the main loop, which does the
+ * formatting and the disk work at normal priority. The arena and the queue
+ * are single producer, single consumer; the main loop is woken through a
+ * pipe, like the log setup thread.
+ */
+struct rt_reader
+{
+	int fd;
+	int cpu;			// -1: no affinity
+	int prio;			// SCHED_FIFO priority, 0: normal
+	bool lock;			// mlockall()
+	long baud_rate;
+
+	pthread_t thread;
+	bool running;
+	int pipe_fd[2];
+	int notified;
+	int stop;
+	int ended;			// the port hung up or failed
+	int error;
+
+	u8 *arena;
+	u64 arena_tail;			// released by the main loop
+	struct rt_chunk queue[RT_QUEUE_LEN];
+	u32 queue_head;
+	u32 queue_tail;
+
+	// Statistics
+	u64 reads;
+	u64 bytes;
+	u64 dropped;
+	u32 max_read;			// most bytes the kernel held at one read
+	u64 max_queue_ns;		// longest wait of a chunk for the main loop
+
+	bool icount_valid;
+	int icount_start[5];		// rx, frame, parity, overrun, buf_overrun
+};
+
+extern int rt_start(struct rt_reader *rt, int fd, int cpu, int prio,
+		    bool lock, long baud_rate);
+extern void rt_ack(struct rt_reader *rt);
+extern bool rt_pop(struct rt_reader *rt, struct rt_chunk *c, char **data);
+extern void rt_release(struct rt_reader *rt, const struct rt_chunk *c);
+extern bool rt_ended(struct rt_reader *rt);
+extern void rt_stop(struct rt_reader *rt);
+extern void rt_close(struct rt_reader *rt);
+extern void rt_report(struct rt_reader *rt);
+
+#endif
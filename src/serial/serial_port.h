@@ -9,6 +9,28 @@ struct serial_cfg
 	char *dev_name;
 	long baud_rate;
 	long file_size_limit;
+	int limit_mode;
+	long rotate_keep;
+	long head_size;
+	long tail_size;
+	long min_free;
+	char *record;
+	int record_format;
+	int frame_type;
+	int frame_crc;
+	char *frame_out;
+	bool dedup;
+	bool dedup_file;
+	int dedup_window;
+	long rate_limit;
+	bool line_stage;
+	char *trace;
+	char *shm;
+	long shm_size;
+	bool rt;
+	int rt_cpu;
+	int rt_prio;
+	bool rt_lock;
 	bool help;
 	bool output_file;
 	bool save;
@@ -16,6 +38,8 @@ struct serial_cfg
 	bool onlret;
 	bool onlcr;
 	bool time;
+	bool hex;
+	bool hex_tx;
 };
 
 extern int serial_port_init(int fd, struct serial_cfg *cfg);
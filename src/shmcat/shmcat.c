@@ -0,0 +1,91 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "global.h"
+#include "shmring.h"
+
+/*
+ * atty-shmcat: a sample consumer of the ring atty publishes with --shm. It
+ * follows the writer without locks and copies the received bytes to stdout
+ * until atty exits.
+ */
+
+#define SHMCAT_IDLE_NS			(1000000)	// poll the head every 1 ms when idle
+
+void usage(const char *prog)
+{
+	printf("Usage: %s [-v] <name>\n"
+		"Copy the bytes atty publishes to /dev/shm/<name> to stdout.\n"
+		"  -v                 Show the sequence, offset and time of every chunk\n"
+		"  -h                 Show this help\n",
+		prog);
+}
+
+int main(int argc, char *argv[])
+{
+	static char buf[SHMRING_REC_MAX];
+	struct timespec idle = { 0, SHMCAT_IDLE_NS };
+	struct shmring_reader r;
+	struct shmring_rec rec;
+	bool verbose = false;
+	u64 chunks = 0;
+	int opt, n;
+
+	while ((opt = getopt(argc, argv, "hv")) != -1) {
+		switch (opt) {
+		case 'v':
+			verbose = true;
+			break;
+		case 'h':
+			usage(argv[0]);
+			exit(EXIT_SUCCESS);
+		default:
+			usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (shmring_open(&r, argv[optind]))
+		exit(EXIT_FAILURE);
+
+	fprintf(stderr, "Info: Following %s, %llu byte ring\n", r.hdr->port, r.size);
+
+	while (1) {
+		n = shmring_read(&r, &rec, buf, sizeof(buf));
+		if (n > 0) {
+			if (verbose)
+				printf("\n[seq %llu offset %llu mono %llu.%09llu]\n",
+					rec.seq, rec.offset, rec.mono_ns / 1000000000ULL,
+					rec.mono_ns % 1000000000ULL);
+			fwrite(buf, 1, n, stdout);
+			chunks++;
+			continue;
+		}
+
+		if (n == -EOVERFLOW) {
+			fprintf(stderr, "\nWarning: Fell behind, %llu bytes lost\n", r.lost);
+			continue;
+		}
+
+		fflush(stdout);
+		if (shmring_closed(&r))
+			break;
+		nanosleep(&idle, NULL);
+	}
+
+	fprintf(stderr, "\nInfo: %llu chunks read, %llu laps, %llu bytes lost\n",
+		chunks, r.laps, r.lost);
+	shmring_close(&r);
+
+	return EXIT_SUCCESS;
+}
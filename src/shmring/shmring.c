@@ -0,0 +1,261 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "shmring.h"
+
+static inline u64 shmring_rec_size(u64 len)
+{
+	return (sizeof(struct shmring_rec) + len + SHMRING_ALIGN - 1) & ~(u64)(SHMRING_ALIGN - 1);
+}
+
+// shm_open() wants a single leading '/'
+static void shmring_name(char *buf, const char *name)
+{
+	snprintf(buf, SHMRING_NAME_MAX, "%s%s", name[0] == '/' ? "" : "/", name);
+}
+
+/*
+ * Create the ring /dev/shm/<name>, replacing a stale one. The size is
+ * rounded up to a power of 2.
+ */
+int shmring_create(struct shmring *ring, const char *name, u64 size,
+		   const char *port)
+{
+	size_t map_size;
+	u64 s = SHMRING_MIN_SIZE;
+	void *p;
+	int fd;
+
+	while (s < size)
+		s <<= 1;
+
+	memset(ring, 0, sizeof(*ring));
+	shmring_name(ring->name, name);
+	ring->size = s;
+	map_size = sizeof(struct shmring_hdr) + s;
+
+	shm_unlink(ring->name);
+	fd = shm_open(ring->name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Error: Failed to create the shared memory ring %s: %s (%d)\n",
+			ring->name, strerror(errno), errno);
+		return -errno;
+	}
+
+	if (ftruncate(fd, map_size) < 0) {
+		fprintf(stderr, "Error: Failed to size the shared memory ring %s: %s (%d)\n",
+			ring->name, strerror(errno), errno);
+		close(fd);
+		shm_unlink(ring->name);
+		return -errno;
+	}
+
+	p = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		fprintf(stderr, "Error: Failed to map the shared memory ring %s: %s (%d)\n",
+			ring->name, strerror(errno), errno);
+		shm_unlink(ring->name);
+		return -errno;
+	}
+
+	ring->hdr = p;
+	ring->data = (u8 *)p + sizeof(struct shmring_hdr);
+
+	memcpy(ring->hdr->magic, SHMRING_MAGIC, sizeof(ring->hdr->magic));
+	ring->hdr->version = SHMRING_VERSION;
+	ring->hdr->hdr_size = sizeof(struct shmring_hdr);
+	ring->hdr->size = s;
+	ring->hdr->rec_max = SHMRING_REC_MAX;
+	ring->hdr->writer_pid = getpid();
+	snprintf(ring->hdr->port, sizeof(ring->hdr->port), "%s", port);
+	__atomic_store_n(&ring->hdr->head, 0, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/*
+ * Copy a received chunk into the ring and publish it with one release store
+ * of head. Readers never block the writer; one that falls a lap behind
+ * notices it and skips ahead.
+ */
+void shmring_publish(struct shmring *ring, const void *data, size_t len,
+		     u64 offset, const struct timespec *mono)
+{
+	const u8 *s = data;
+	struct shmring_rec *rec;
+	u64 mask = ring->size - 1;
+	u64 total, room;
+	size_t n;
+
+	while (len) {
+		n = len < SHMRING_REC_MAX ? len : SHMRING_REC_MAX;
+		total = shmring_rec_size(n);
+
+		// A record never wraps, the rest of the ring is padded instead
+		room = ring->size - (ring->head & mask);
+		if (room < total) {
+			rec = (struct shmring_rec *)(ring->data + (ring->head & mask));
+			rec->len = room;
+			rec->flags = SHMRING_FLAG_PAD;
+			ring->head += room;
+		}
+
+		rec = (struct shmring_rec *)(ring->data + (ring->head & mask));
+		rec->len = n;
+		rec->flags = 0;
+		rec->seq = ring->seq++;
+		rec->mono_ns = (u64)mono->tv_sec * 1000000000ULL + mono->tv_nsec;
+		rec->offset = offset;
+		memcpy(rec + 1, s, n);
+
+		ring->head += total;
+		__atomic_store_n(&ring->hdr->head, ring->head, __ATOMIC_RELEASE);
+
+		s += n;
+		len -= n;
+		offset += n;
+	}
+
+	/*
+	 * Keep the stores of the next record behind this head for the readers'
+	 * lap check; a compiler barrier only on x86.
+	 */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void shmring_destroy(struct shmring *ring)
+{
+	if (ring->hdr == NULL)
+		return;
+
+	// Readers that have it mapped drain what is left and stop
+	__atomic_store_n(&ring->hdr->closed, 1, __ATOMIC_RELEASE);
+	munmap(ring->hdr, sizeof(struct shmring_hdr) + ring->size);
+	shm_unlink(ring->name);
+	ring->hdr = NULL;
+}
+
+/*
+ * Map the ring read-only. Reading starts at the current head, i.e. with the
+ * next chunk atty receives.
+ */
+int shmring_open(struct shmring_reader *r, const char *name)
+{
+	char shm_name[SHMRING_NAME_MAX];
+	struct shmring_hdr hdr;
+	struct stat st;
+	void *p;
+	int fd;
+
+	memset(r, 0, sizeof(*r));
+	shmring_name(shm_name, name);
+
+	fd = shm_open(shm_name, O_RDONLY, 0);
+	if (fd < 0) {
+		fprintf(stderr, "Error: Failed to open the shared memory ring %s: %s (%d)\n",
+			shm_name, strerror(errno), errno);
+		return -errno;
+	}
+
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(hdr) ||
+	    pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    memcmp(hdr.magic, SHMRING_MAGIC, sizeof(hdr.magic)) != 0 ||
+	    hdr.version != SHMRING_VERSION || hdr.hdr_size != sizeof(hdr) ||
+	    (size_t)st.st_size < sizeof(hdr) + hdr.size) {
+		fprintf(stderr, "Error: %s is not an atty shared memory ring\n", shm_name);
+		close(fd);
+		return -EINVAL;
+	}
+
+	p = mmap(NULL, sizeof(hdr) + hdr.size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		fprintf(stderr, "Error: Failed to map the shared memory ring %s: %s (%d)\n",
+			shm_name, strerror(errno), errno);
+		return -errno;
+	}
+
+	r->hdr = p;
+	r->data = (const u8 *)p + sizeof(hdr);
+	r->size = hdr.size;
+	r->pos = __atomic_load_n(&r->hdr->head, __ATOMIC_ACQUIRE);
+
+	return 0;
+}
+
+// The writer may be rewriting the bytes at pos: skip to the head
+static int shmring_lapped(struct shmring_reader *r, u64 head)
+{
+	r->laps++;
+	r->lost += head - r->pos;
+	r->pos = head;
+	return -EOVERFLOW;
+}
+
+/*
+ * Copy the next chunk to buf, truncated to size. Returns its length, 0 when
+ * there is nothing new, or -EOVERFLOW when the writer lapped the reader, in
+ * which case reading goes on from the latest chunk.
+ */
+int shmring_read(struct shmring_reader *r, struct shmring_rec *rec,
+		 void *buf, size_t size)
+{
+	u64 mask = r->size - 1;
+	u64 head, off;
+	size_t n;
+
+	head = __atomic_load_n(&r->hdr->head, __ATOMIC_ACQUIRE);
+
+	while (r->pos != head) {
+		if (head - r->pos > r->size - SHMRING_MARGIN)
+			return shmring_lapped(r, head);
+
+		off = r->pos & mask;
+		memcpy(rec, r->data + off, sizeof(*rec));
+		n = 0;
+		if (!(rec->flags & SHMRING_FLAG_PAD)) {
+			// A torn header must not take the copy out of the ring
+			n = rec->len < size ? rec->len : size;
+			if (n > r->size - off - sizeof(*rec))
+				n = r->size - off - sizeof(*rec);
+			memcpy(buf, r->data + off + sizeof(*rec), n);
+		}
+
+		// The copy is good if the writer has not come near it meanwhile
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		head = __atomic_load_n(&r->hdr->head, __ATOMIC_RELAXED);
+		if (head - r->pos > r->size - SHMRING_MARGIN)
+			return shmring_lapped(r, head);
+
+		if (rec->flags & SHMRING_FLAG_PAD) {
+			r->pos += rec->len;
+			continue;
+		}
+
+		r->pos += shmring_rec_size(rec->len);
+		return n;
+	}
+
+	return 0;
+}
+
+bool shmring_closed(const struct shmring_reader *r)
+{
+	return __atomic_load_n(&r->hdr->closed, __ATOMIC_ACQUIRE) &&
+	       r->pos == __atomic_load_n(&r->hdr->head, __ATOMIC_ACQUIRE);
+}
+
+void shmring_close(struct shmring_reader *r)
+{
+	if (r->hdr) {
+		munmap((void *)r->hdr, sizeof(struct shmring_hdr) + r->size);
+		r->hdr = NULL;
+	}
+}
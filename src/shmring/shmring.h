@@ -0,0 +1,89 @@
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <stddef.h>
+#include <time.h>
+#include "types.h"
+
+#define SHMRING_MAGIC			"ATTYSHM1"
+#define SHMRING_VERSION			(1)
+
+#define SHMRING_NAME_MAX		(256)
+#define SHMRING_PORT_MAX		(64)
+#define SHMRING_DEFAULT_SIZE		(4 * MB)
+#define SHMRING_MIN_SIZE		(1 * MB)
+
+// Records and the pad at the end of the ring are multiples of this
+#define SHMRING_ALIGN			(32)
+#define SHMRING_REC_MAX			(64 * 1024)	// larger chunks are split
+
+/*
+ * Bytes the writer may touch past the published head: a pad up to the end
+ * of the ring plus the largest record.
+ */
+#define SHMRING_MARGIN			(2 * (SHMRING_REC_MAX + 2 * SHMRING_ALIGN))
+
+#define SHMRING_FLAG_PAD		(1 << 0)	// skip to the start of the ring
+
+/*
+ * The shared object holds this header followed by the data area. head is
+ * the number of bytes ever written; a record starts at head % size, so the
+ * position of a record is its sequence number in bytes.
+ */
+struct shmring_hdr
+{
+	char magic[8];
+	u32 version;
+	u32 hdr_size;
+	u64 size;			// of the data area, power of 2
+	u32 rec_max;
+	u32 writer_pid;
+	u32 closed;			// set when atty exits
+	u32 reserved;
+	char port[SHMRING_PORT_MAX];
+	u64 head __attribute__((aligned(64)));
+};
+
+struct shmring_rec
+{
+	u32 len;			// payload bytes, or the pad up to the end
+	u16 flags;
+	u16 reserved;
+	u64 seq;			// counts the records
+	u64 mono_ns;			// CLOCK_MONOTONIC of the read()
+	u64 offset;			// of the first byte in the received stream
+};
+
+struct shmring
+{
+	char name[SHMRING_NAME_MAX];
+	struct shmring_hdr *hdr;
+	u8 *data;
+	u64 size;
+	u64 head;
+	u64 seq;
+};
+
+struct shmring_reader
+{
+	const struct shmring_hdr *hdr;
+	const u8 *data;
+	u64 size;
+	u64 pos;
+	u64 laps;
+	u64 lost;			// bytes overwritten before they were read
+};
+
+extern int shmring_create(struct shmring *ring, const char *name, u64 size,
+			  const char *port);
+extern void shmring_publish(struct shmring *ring, const void *data, size_t len,
+			    u64 offset, const struct timespec *mono);
+extern void shmring_destroy(struct shmring *ring);
+
+extern int shmring_open(struct shmring_reader *r, const char *name);
+extern int shmring_read(struct shmring_reader *r, struct shmring_rec *rec,
+			void *buf, size_t size);
+extern bool shmring_closed(const struct shmring_reader *r);
+extern void shmring_close(struct shmring_reader *r);
+
+#endif
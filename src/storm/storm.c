@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "storm.h"
+
+// A run of repeats that keeps going is still reported this often
+#define STORM_REPORT_S			(10)
+
+#define FNV1A_OFFSET			(0xcbf29ce484222325ULL)
+#define FNV1A_PRIME			(0x100000001b3ULL)
+
+static u64 storm_hash(const char *s, size_t len)
+{
+	u64 h = FNV1A_OFFSET;
+
+	for (size_t i = 0; i < len; i++) {
+		h ^= (u8)s[i];
+		h *= FNV1A_PRIME;
+	}
+
+	return h;
+}
+
+// Lines compare without their terminator
+static size_t storm_trim(const char *s, size_t len)
+{
+	if (len && s[len - 1] == '\n')
+		len--;
+	if (len && s[len - 1] == '\r')
+		len--;
+	return len;
+}
+
+void storm_init(struct storm *st, bool dedup, int window, long rate)
+{
+	memset(st, 0, sizeof(*st));
+	st->dedup = dedup;
+	st->window = window;
+	st->rate = rate;
+}
+
+static void storm_report_repeats(struct storm *st, storm_emit_t emit, void *ctx)
+{
+	char note[STORM_NOTE_MAX];
+	int len;
+
+	len = snprintf(note, sizeof(note), "[last message repeated %llu times]\n",
+		       st->repeats);
+	emit(STORM_NOTE_REPEAT, st->prev_tag, note, len, ctx);
+	st->repeats = 0;
+}
+
+static void storm_report_entry(struct storm *st, struct storm_entry *e,
+			       storm_emit_t emit, void *ctx)
+{
+	char note[STORM_NOTE_MAX];
+	int len;
+
+	if (e->count == 0)
+		return;
+
+	len = snprintf(note, sizeof(note), "[message repeated %u times in %d s: %.*s]\n",
+		       e->count, st->window, e->len, e->text);
+	emit(STORM_NOTE_REPEAT, e->tag, note, len, ctx);
+	e->count = 0;
+	st->pending--;
+}
+
+static void storm_report_rate(struct storm *st, storm_emit_t emit, void *ctx)
+{
+	char note[STORM_NOTE_MAX];
+	int len;
+
+	len = snprintf(note, sizeof(note), "[%llu lines suppressed by the rate limit]\n",
+		       st->rate_dropped);
+	emit(STORM_NOTE_RATE, 0, note, len, ctx);
+	st->rate_dropped = 0;
+}
+
+/*
+ * Returns false when the line is a repeat to be collapsed. Summaries of
+ * earlier repeats are passed to emit before the line itself is let through.
+ * The tag of the line is kept and passed back with its own summary.
+ */
+bool storm_check(struct storm *st, const char *s, size_t len, time_t now,
+		 u32 tag, storm_emit_t emit, void *ctx)
+{
+	struct storm_entry *e;
+	u64 h;
+
+	if (now != st->tick_sec)
+		storm_tick(st, now, false, emit, ctx);
+
+	if (!st->dedup)
+		return true;
+
+	len = storm_trim(s, len);
+	h = storm_hash(s, len);
+
+	if (st->window == 0) {
+		if (st->prev_valid && h == st->prev_hash) {
+			if (st->repeats++ == 0)
+				st->repeat_sec = now;
+			st->collapsed++;
+			return false;
+		}
+		storm_break(st, emit, ctx);
+		st->prev_hash = h;
+		st->prev_tag = tag;
+		st->prev_valid = true;
+		return true;
+	}
+
+	e = &st->table[h & (STORM_TABLE_SIZE - 1)];
+	if (e->used && e->hash == h && now - e->first < st->window) {
+		if (e->count++ == 0)
+			st->pending++;
+		st->collapsed++;
+		return false;
+	}
+
+	// The slot held an expired line or another line with the same index
+	if (e->used)
+		storm_report_entry(st, e, emit, ctx);
+
+	e->used = true;
+	e->hash = h;
+	e->tag = tag;
+	e->first = now;
+	e->count = 0;
+	e->len = len < STORM_TEXT_MAX ? len : STORM_TEXT_MAX;
+	memcpy(e->text, s, e->len);
+
+	return true;
+}
+
+// The run of consecutive repeats is interrupted, e.g. by a partial line
+void storm_break(struct storm *st, storm_emit_t emit, void *ctx)
+{
+	if (st->repeats)
+		storm_report_repeats(st, emit, ctx);
+	st->prev_valid = false;
+}
+
+// Returns false when the line exceeds the lines per second limit
+bool storm_rate(struct storm *st, time_t now, storm_emit_t emit, void *ctx)
+{
+	if (st->rate <= 0)
+		return true;
+
+	if (now != st->rate_sec) {
+		if (st->rate_dropped)
+			storm_report_rate(st, emit, ctx);
+		st->rate_sec = now;
+		st->rate_count = 0;
+	}
+
+	if (st->rate_count >= st->rate) {
+		st->rate_dropped++;
+		st->limited++;
+		return false;
+	}
+	st->rate_count++;
+
+	return true;
+}
+
+bool storm_pending(struct storm *st)
+{
+	return st->repeats || st->pending || st->rate_dropped;
+}
+
+/*
+ * Report what is due: a run of repeats older than STORM_REPORT_S, window
+ * entries that expired and the lines dropped by the rate limit in an
+ * earlier second. With force, everything pending is reported.
+ */
+void storm_tick(struct storm *st, time_t now, bool force, storm_emit_t emit,
+		void *ctx)
+{
+	st->tick_sec = now;
+
+	if (st->repeats && (force || now - st->repeat_sec >= STORM_REPORT_S))
+		storm_report_repeats(st, emit, ctx);
+
+	if (st->pending) {
+		for (int i = 0; i < STORM_TABLE_SIZE; i++) {
+			struct storm_entry *e = &st->table[i];
+
+			if (e->count && (force || now - e->first >= st->window)) {
+				storm_report_entry(st, e, emit, ctx);
+				e->used = false;
+			}
+		}
+	}
+
+	if (st->rate_dropped && (force || now != st->rate_sec))
+		storm_report_rate(st, emit, ctx);
+}
@@ -0,0 +1,77 @@
+#ifndef STORM_H
+#define STORM_H
+
+#include <stddef.h>
+#include <time.h>
+#include "types.h"
+
+#define STORM_TABLE_SIZE		(64)		// power of 2
+#define STORM_TEXT_MAX			(64)
+#define STORM_NOTE_MAX			(STORM_TEXT_MAX + 128)
+
+enum storm_note {
+	STORM_NOTE_REPEAT = 0,		// summary of collapsed repeats
+	STORM_NOTE_RATE,		// summary of lines over the rate limit
+};
+
+/*
+ * tag is the one given to storm_check() with the line a repeat summary is
+ * about, 0 for the rate summaries.
+ */
+typedef void (*storm_emit_t)(int kind, u32 tag, const char *s, size_t len,
+			     void *ctx);
+
+struct storm_entry
+{
+	u64 hash;
+	u32 tag;
+	time_t first;			// when the line was let through
+	u32 count;			// repeats collapsed since then
+	bool used;
+	u16 len;
+	char text[STORM_TEXT_MAX];
+};
+
+/*
+ * Message storm suppression. Completed lines are hashed once; with a window
+ * of 0 only consecutive repeats are collapsed, otherwise a line already let
+ * through in the last window seconds is collapsed too. The recent lines live
+ * in a small direct-mapped table, so the cost per line does not depend on
+ * the window. The rate limit caps the lines per second and is meant for the
+ * console only.
+ */
+struct storm
+{
+	bool dedup;
+	int window;
+	long rate;
+
+	u64 prev_hash;
+	u32 prev_tag;
+	bool prev_valid;
+	u64 repeats;
+	time_t repeat_sec;
+
+	struct storm_entry table[STORM_TABLE_SIZE];
+	u32 pending;			// entries with a count
+
+	time_t rate_sec;
+	long rate_count;
+	u64 rate_dropped;
+
+	time_t tick_sec;
+
+	u64 collapsed;
+	u64 limited;
+};
+
+extern void storm_init(struct storm *st, bool dedup, int window, long rate);
+extern bool storm_check(struct storm *st, const char *s, size_t len, time_t now,
+			u32 tag, storm_emit_t emit, void *ctx);
+extern void storm_break(struct storm *st, storm_emit_t emit, void *ctx);
+extern bool storm_rate(struct storm *st, time_t now, storm_emit_t emit, void *ctx);
+extern bool storm_pending(struct storm *st);
+extern void storm_tick(struct storm *st, time_t now, bool force,
+		       storm_emit_t emit, void *ctx);
+
+#endif
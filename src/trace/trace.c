@@ -0,0 +1,193 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+
+static const char *span_names[TRACE_SPANS] = {
+	[TRACE_POLL]		= "poll wait",
+	[TRACE_READ]		= "read",
+	[TRACE_FRAME]		= "frame decode",
+	[TRACE_FORMAT]		= "format",
+	[TRACE_CONSOLE]		= "console write",
+	[TRACE_LOG]		= "log write",
+	[TRACE_RECORD]		= "record write",
+	[TRACE_STDIN]		= "stdin forward",
+	[TRACE_LOG_SETUP]	= "log setup",
+};
+
+bool trace_enabled;
+volatile sig_atomic_t trace_dump_requested;
+
+static struct trace_buf bufs[TRACE_THREADS_MAX];
+static int bufs_len;
+static __thread struct trace_buf *local_buf;
+
+static const char *trace_file;
+static u64 tick0;
+static struct timespec mono0;
+
+static void trace_sigusr1(int sig)
+{
+	trace_dump_requested = 1;
+}
+
+static int trace_buf_new(const char *name, u32 events)
+{
+	struct trace_buf *buf;
+	struct trace_event *ev;
+	int i;
+
+	i = __atomic_fetch_add(&bufs_len, 1, __ATOMIC_RELAXED);
+	if (i >= TRACE_THREADS_MAX)
+		return -ENOSPC;
+
+	ev = malloc(events * sizeof(*ev));
+	if (ev == NULL) {
+		fprintf(stderr, "Error: Failed to allocate the trace buffer: %s (%d)\n",
+			strerror(errno), errno);
+		return -ENOMEM;
+	}
+	// Fault the pages in now rather than on the traced path
+	memset(ev, 0, events * sizeof(*ev));
+
+	buf = &bufs[i];
+	buf->name = name;
+	buf->tid = syscall(SYS_gettid);
+	buf->size = events;
+	buf->head = 0;
+	__atomic_store_n(&buf->events, ev, __ATOMIC_RELEASE);
+	local_buf = buf;
+
+	return 0;
+}
+
+/*
+ * Start tracing to file_name. The trace is written on SIGUSR1 and by
+ * trace_close().
+ */
+int trace_init(const char *file_name)
+{
+	int ret;
+
+	trace_file = file_name;
+	clock_gettime(CLOCK_MONOTONIC, &mono0);
+	tick0 = trace_now();
+
+	ret = trace_buf_new("main", TRACE_MAIN_EVENTS);
+	if (ret)
+		return ret;
+
+	signal(SIGUSR1, trace_sigusr1);
+	trace_enabled = true;
+
+	return 0;
+}
+
+// Give the calling thread its own buffer, a no-op when tracing is off
+int trace_thread(const char *name, u32 events)
+{
+	if (!trace_enabled)
+		return 0;
+	return trace_buf_new(name, events);
+}
+
+void trace_record(int span, u64 begin, u64 end, u32 arg)
+{
+	struct trace_buf *buf = local_buf;
+	struct trace_event *ev;
+
+	if (buf == NULL)
+		return;
+
+	ev = &buf->events[buf->head & (buf->size - 1)];
+	ev->begin = begin;
+	ev->end = end;
+	ev->arg = arg;
+	ev->span = span;
+	__atomic_store_n(&buf->head, buf->head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Write all the buffered events in the Chrome trace event format, which
+ * chrome://tracing and Perfetto load. Times are in microseconds since
+ * trace_init().
+ */
+int trace_dump(void)
+{
+	struct timespec mono1;
+	double us_per_tick;
+	u64 tick1, events = 0;
+	bool first = true;
+	int pid = getpid();
+	FILE *fp;
+
+	trace_dump_requested = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &mono1);
+	tick1 = trace_now();
+	us_per_tick = ((mono1.tv_sec - mono0.tv_sec) * 1e6 +
+		       (mono1.tv_nsec - mono0.tv_nsec) / 1e3);
+	us_per_tick = tick1 > tick0 ? us_per_tick / (tick1 - tick0) : 0;
+
+	fp = fopen(trace_file, "w");
+	if (fp == NULL) {
+		fprintf(stderr, "Error: Failed to open the trace file '%s': %s (%d)\n",
+			trace_file, strerror(errno), errno);
+		return -errno;
+	}
+
+	fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+	for (int i = 0; i < bufs_len && i < TRACE_THREADS_MAX; i++) {
+		struct trace_buf *buf = &bufs[i];
+		struct trace_event *ev = __atomic_load_n(&buf->events, __ATOMIC_ACQUIRE);
+		u32 head, n;
+
+		if (ev == NULL)
+			continue;
+
+		fprintf(fp, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+			"\"args\":{\"name\":\"%s\"}}",
+			first ? "" : ",", pid, buf->tid, buf->name);
+		first = false;
+
+		head = __atomic_load_n(&buf->head, __ATOMIC_ACQUIRE);
+		n = head < buf->size ? head : buf->size;
+
+		for (u32 k = head - n; k != head; k++) {
+			struct trace_event *e = &ev[k & (buf->size - 1)];
+
+			fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+				"\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"bytes\":%u}}",
+				span_names[e->span], pid, buf->tid,
+				(e->begin - tick0) * us_per_tick,
+				(e->end - e->begin) * us_per_tick, e->arg);
+		}
+		events += n;
+	}
+
+	fprintf(fp, "\n]}\n");
+
+	if (fclose(fp)) {
+		fprintf(stderr, "Error: Failed to write the trace file '%s': %s (%d)\n",
+			trace_file, strerror(errno), errno);
+		return -errno;
+	}
+
+	printf("\nInfo: Wrote %llu trace events to '%s'\n", events, trace_file);
+
+	return 0;
+}
+
+void trace_close(void)
+{
+	if (!trace_enabled)
+		return;
+
+	trace_dump();
+	trace_enabled = false;
+}
@@ -0,0 +1,92 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <signal.h>
+#include <time.h>
+#include "types.h"
+
+#define TRACE_MAIN_EVENTS		(64 * 1024)
+#define TRACE_THREAD_EVENTS		(4 * 1024)
+#define TRACE_THREADS_MAX		(4)
+
+enum trace_span {
+	TRACE_POLL = 0,
+	TRACE_READ,
+	TRACE_FRAME,
+	TRACE_FORMAT,
+	TRACE_CONSOLE,
+	TRACE_LOG,
+	TRACE_RECORD,
+	TRACE_STDIN,
+	TRACE_LOG_SETUP,
+	TRACE_SPANS,
+};
+
+struct trace_event
+{
+	u64 begin;
+	u64 end;
+	u32 arg;			// bytes, where it applies
+	u16 span;
+	u16 reserved;
+};
+
+/*
+ * Events of one thread. The buffer is allocated and touched when the thread
+ * registers and then used as a ring, so the latest events are kept.
+ */
+struct trace_buf
+{
+	const char *name;
+	int tid;
+	u32 size;			// power of 2
+	u32 head;
+	struct trace_event *events;
+};
+
+extern bool trace_enabled;
+extern volatile sig_atomic_t trace_dump_requested;
+
+extern int trace_init(const char *file_name);
+extern int trace_thread(const char *name, u32 events);
+extern void trace_record(int span, u64 begin, u64 end, u32 arg);
+extern int trace_dump(void);
+extern void trace_close(void);
+
+static inline u64 trace_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	u32 lo, hi;
+
+	__asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+	return ((u64)hi << 32) | lo;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/*
+ * A span is traced as
+ *   u64 t = trace_begin();
+ *   ...
+ *   trace_end(TRACE_READ, t, len);
+ * With tracing off, trace_begin() returns 0 and each probe costs one branch
+ * that is always predicted right.
+ */
+static inline u64 trace_begin(void)
+{
+	if (__builtin_expect(!trace_enabled, 1))
+		return 0;
+	return trace_now();
+}
+
+static inline void trace_end(int span, u64 begin, u32 arg)
+{
+	if (__builtin_expect(begin != 0, 0))
+		trace_record(span, begin, trace_now(), arg);
+}
+
+#endif